@@ -0,0 +1,571 @@
+// I2L interpreter - static control flow analysis
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// Code is found by following control flow from the start of the main
+// program, so that strings and other data embedded in the code are
+// not mistaken for instructions.  The result is used to report basic
+// blocks, the call graph, loops, case statement chains and the static
+// instruction mix, and by the load time code transformations.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+uint8_t code_flags[MAX_MEM];
+
+block_t *blocks;
+int block_count;
+static int *block_at;  // block index by start address, or -1
+
+
+int insn_length(uint16_t addr)
+{
+  uint8_t opcode = mem[addr];
+  if (opcode >= 0x80)
+    return 1;  // short global load
+  if (! op[opcode].fn)
+    return 0;
+  return class_bytes[op[opcode].class];
+}
+
+
+const char *insn_name(uint16_t addr)
+{
+  uint8_t opcode = mem[addr];
+  if (opcode >= 0x80)
+    return "lod";  // short global load
+  if (! op[opcode].name)
+    return "???";
+  return op[opcode].name;
+}
+
+
+// Returns the address that an instruction can transfer control to,
+// other than the next instruction.
+bool insn_target(uint16_t addr, uint16_t *target)
+{
+  switch (mem[addr])
+    {
+    case 0x05:  // CAL
+      *target = read16(addr + 2);
+      return true;
+    case 0x07:  // JMP
+    case 0x08:  // JPC
+    case 0x18:  // FOR
+    case 0x25:  // CJP
+    case 0x26:  // JSR
+      *target = read16(addr + 1);
+      return true;
+    }
+  return false;
+}
+
+
+// Whether execution can continue with the next instruction.
+bool insn_falls_through(uint16_t addr)
+{
+  switch (mem[addr])
+    {
+    case 0x00:  // EXIT
+    case 0x06:  // RET
+    case 0x07:  // JMP
+    case 0x27:  // RTS
+      return false;
+    }
+  return true;
+}
+
+
+static bool in_code(uint32_t addr)
+{
+  return (addr >= CODE_START) && (addr < heap_start);
+}
+
+
+static void find_code(void)
+{
+  uint16_t *work = malloc(MAX_MEM * sizeof(uint16_t));
+  int count = 0;
+
+  if (! work)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+
+  memset(code_flags, 0, sizeof(code_flags));
+  code_flags[CODE_START] |= CF_PROC | CF_LEADER;
+  work[count++] = CODE_START;
+
+  while (count)
+    {
+      uint16_t addr = work[--count];
+      while (in_code(addr) && ! (code_flags[addr] & (CF_INSN | CF_BAD)))
+	{
+	  uint16_t target;
+	  int len = insn_length(addr);
+	  if ((! len) || ! in_code(addr + len - 1))
+	    {
+	      code_flags[addr] |= CF_BAD;
+	      break;
+	    }
+	  code_flags[addr] |= CF_INSN;
+
+	  if (insn_target(addr, & target) && in_code(target))
+	    {
+	      if (mem[addr] == 0x05)
+		code_flags[target] |= CF_PROC;
+	      else if (mem[addr] == 0x26)
+		code_flags[target] |= CF_SUB;
+	      else
+		code_flags[target] |= CF_TARGET;
+	      code_flags[target] |= CF_LEADER;
+	      if (! (code_flags[target] & CF_INSN))
+		work[count++] = target;
+	    }
+
+	  if (! insn_falls_through(addr))
+	    break;
+	  if (insn_target(addr, & target))
+	    code_flags[addr + len] |= CF_LEADER;
+	  addr += len;
+	}
+    }
+  free(work);
+}
+
+
+static void find_blocks(void)
+{
+  uint32_t addr;
+  int allocated = 0;
+
+  block_count = 0;
+  free(block_at);
+  block_at = malloc(MAX_MEM * sizeof(int));
+  if (! block_at)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+  for (addr = 0; addr < MAX_MEM; addr++)
+    block_at[addr] = -1;
+
+  for (addr = CODE_START; addr < heap_start; addr++)
+    {
+      block_t *b;
+      uint16_t a;
+      uint16_t target;
+
+      if (! (code_flags[addr] & CF_INSN))
+	continue;
+
+      if (block_count == allocated)
+	{
+	  allocated = allocated ? allocated * 2 : 256;
+	  blocks = realloc(blocks, allocated * sizeof(block_t));
+	  if (! blocks)
+	    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+	}
+      b = & blocks[block_count];
+      memset(b, 0, sizeof(*b));
+      b->start = addr;
+
+      a = addr;
+      while (true)
+	{
+	  int len = insn_length(a);
+	  b->insns++;
+	  b->last = a;
+	  a += len;
+	  if (! insn_falls_through(b->last) ||
+	      insn_target(b->last, & target) ||
+	      ! (code_flags[a] & CF_INSN) ||
+	      (code_flags[a] & CF_LEADER))
+	    break;
+	}
+      b->end = a;
+
+      // calls return to the next instruction, so only other
+      // transfers are control flow edges within a procedure
+      if (insn_target(b->last, & target) && in_code(target) &&
+	  (mem[b->last] != 0x05) && (mem[b->last] != 0x26))
+	b->succ[b->nsucc++] = target;
+      if (insn_falls_through(b->last) && (code_flags[b->end] & CF_INSN))
+	b->succ[b->nsucc++] = b->end;
+
+      block_at[addr] = block_count++;
+
+      // let the loop resume at the end of this block
+      addr = b->end - 1;
+    }
+}
+
+
+// Assigns each block to the first procedure or subroutine that
+// reaches it.
+static void assign_procs(void)
+{
+  int *work = malloc(block_count * sizeof(int));
+  uint32_t addr;
+
+  if (! work)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+
+  // every procedure owns its entry block
+  for (addr = CODE_START; addr < heap_start; addr++)
+    if ((code_flags[addr] & (CF_PROC | CF_SUB)) && (block_at[addr] >= 0))
+      blocks[block_at[addr]].proc = addr;
+
+  for (addr = CODE_START; addr < heap_start; addr++)
+    {
+      int count = 0;
+      if (! (code_flags[addr] & (CF_PROC | CF_SUB)) || (block_at[addr] < 0))
+	continue;
+      work[count++] = block_at[addr];
+      while (count)
+	{
+	  block_t *b = & blocks[work[--count]];
+	  int i;
+	  for (i = 0; i < b->nsucc; i++)
+	    {
+	      int n = block_at[b->succ[i]];
+	      if ((n >= 0) && ! blocks[n].proc)
+		{
+		  blocks[n].proc = addr;
+		  work[count++] = n;
+		}
+	    }
+	}
+    }
+  free(work);
+}
+
+
+void analyze_code(void)
+{
+  find_code();
+  find_blocks();
+  assign_procs();
+}
+
+
+int block_index(uint16_t addr)
+{
+  return block_at[addr];
+}
+
+
+// Constant pushed by an IMS or IMM instruction.
+bool insn_constant(uint16_t addr, uint16_t *value)
+{
+  switch (mem[addr])
+    {
+    case 0x0b:  // IMM
+      *value = read16(addr + 1);
+      return true;
+    case 0x24:  // IMS
+      *value = mem[addr + 1];
+      if (*value & 0x80)
+	*value |= 0xff00;
+      return true;
+    }
+  return false;
+}
+
+
+// A case statement compiles to a test of each arm in turn: a
+// constant and a CJP, which skips to the test for the next arm if the
+// case value doesn't match.  Returns the address of the CJP if there
+// is such a test at addr.
+bool cjp_test(uint16_t addr, uint16_t *cjp)
+{
+  uint16_t value;
+
+  if (! (code_flags[addr] & CF_INSN) || ! insn_constant(addr, & value))
+    return false;
+  *cjp = addr + insn_length(addr);
+  return (code_flags[*cjp] & CF_INSN) && (mem[*cjp] == 0x25);
+}
+
+
+// Number of arms in the chain of case tests starting at addr.
+int cjp_chain_length(uint16_t addr)
+{
+  int count = 0;
+  uint16_t cjp;
+
+  while ((count < MAX_MEM) && cjp_test(addr, & cjp))
+    {
+      count++;
+      addr = read16(cjp + 1);
+    }
+  return count;
+}
+
+
+static void report_calls(FILE *f)
+{
+  char name[64];
+  uint32_t addr;
+  int i, j;
+
+  fprintf(f, "\nprocedures:\n");
+  for (addr = CODE_START; addr < heap_start; addr++)
+    {
+      int nblocks = 0;
+      int insns = 0;
+      bool first = true;
+
+      if (! (code_flags[addr] & (CF_PROC | CF_SUB)))
+	continue;
+      for (i = 0; i < block_count; i++)
+	if (blocks[i].proc == addr)
+	  {
+	    nblocks++;
+	    insns += blocks[i].insns;
+	  }
+      fprintf(f, "  %04" PRIx32 " %-16s %s %4d blocks %5d insns  calls:",
+	      addr, proc_name(addr, name, sizeof(name)),
+	      (code_flags[addr] & CF_PROC) ? "proc" : "sub ",
+	      nblocks, insns);
+
+      // list each callee once
+      for (i = 0; i < block_count; i++)
+	{
+	  uint16_t target;
+	  block_t *b = & blocks[i];
+	  if ((b->proc != addr) ||
+	      ((mem[b->last] != 0x05) && (mem[b->last] != 0x26)) ||
+	      ! insn_target(b->last, & target))
+	    continue;
+	  for (j = 0; j < i; j++)
+	    {
+	      uint16_t t2;
+	      if ((blocks[j].proc == addr) &&
+		  ((mem[blocks[j].last] == 0x05) || (mem[blocks[j].last] == 0x26)) &&
+		  insn_target(blocks[j].last, & t2) && (t2 == target))
+		break;
+	    }
+	  if (j < i)
+	    continue;
+	  fprintf(f, " %s", proc_name(target, name, sizeof(name)));
+	  first = false;
+	}
+      fprintf(f, "%s\n", first ? " none" : "");
+    }
+}
+
+
+// A back edge is an edge to a block that is still on the depth first
+// search stack.  The natural loop is the header plus every block that
+// reaches the back edge without passing through the header.
+static void report_loops(FILE *f)
+{
+  uint8_t *state = calloc(block_count, 1);  // 0 new, 1 on stack, 2 done
+  int *stack = malloc(block_count * sizeof(int));
+  int *edge = malloc(block_count * sizeof(int));
+  uint8_t *in_loop = malloc(block_count);
+  int *work = malloc(block_count * sizeof(int));
+  char name[64];
+  int loops = 0;
+  int root;
+
+  if (! state || ! stack || ! edge || ! in_loop || ! work)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+
+  fprintf(f, "\nloops:\n");
+  for (root = 0; root < block_count; root++)
+    {
+      int sp_ = 0;
+      if (state[root] ||
+	  ! (code_flags[blocks[root].start] & (CF_PROC | CF_SUB)))
+	continue;
+      stack[sp_] = root;
+      edge[sp_++] = 0;
+      state[root] = 1;
+      while (sp_)
+	{
+	  int n = stack[sp_ - 1];
+	  block_t *b = & blocks[n];
+	  if (edge[sp_ - 1] < b->nsucc)
+	    {
+	      int s = block_at[b->succ[edge[sp_ - 1]++]];
+	      if (s < 0)
+		continue;
+	      if (state[s] == 0)
+		{
+		  state[s] = 1;
+		  stack[sp_] = s;
+		  edge[sp_++] = 0;
+		}
+	      else if (state[s] == 1)
+		{
+		  int count = 0;
+		  int body = 1;
+		  int insns = blocks[s].insns;
+		  memset(in_loop, 0, block_count);
+		  in_loop[s] = 1;
+		  if (! in_loop[n])
+		    {
+		      in_loop[n] = 1;
+		      work[count++] = n;
+		    }
+		  while (count)
+		    {
+		      int m = work[--count];
+		      int p;
+		      body++;
+		      insns += blocks[m].insns;
+		      // predecessors, by brute force
+		      for (p = 0; p < block_count; p++)
+			{
+			  int k;
+			  if (in_loop[p])
+			    continue;
+			  for (k = 0; k < blocks[p].nsucc; k++)
+			    if (blocks[p].succ[k] == blocks[m].start)
+			      {
+				in_loop[p] = 1;
+				work[count++] = p;
+				break;
+			      }
+			}
+		    }
+		  fprintf(f, "  header %s", code_name(blocks[s].start, name, sizeof(name)));
+		  fprintf(f, " back edge from %s (%s)  %d blocks %d insns\n",
+			  code_name(blocks[n].last, name, sizeof(name)), insn_name(blocks[n].last),
+			  body, insns);
+		  fprintf(f, "    in %s\n", proc_name(blocks[s].proc, name, sizeof(name)));
+		  loops++;
+		}
+	    }
+	  else
+	    {
+	      state[n] = 2;
+	      sp_--;
+	    }
+	}
+    }
+  if (! loops)
+    fprintf(f, "  none\n");
+
+  free(state);
+  free(stack);
+  free(edge);
+  free(in_loop);
+  free(work);
+}
+
+
+static void report_cjp_chains(FILE *f)
+{
+  char name[64];
+  uint32_t addr;
+  int chains = 0;
+
+  fprintf(f, "\ncase statements:\n");
+  for (addr = CODE_START; addr < heap_start; addr++)
+    {
+      int len;
+      int i;
+      int16_t lo = INT16_MAX;
+      int16_t hi = INT16_MIN;
+      uint16_t a = addr;
+      uint16_t cjp;
+      uint16_t value;
+
+      // only report the first test of each chain
+      if (! cjp_test(addr, & cjp) || (code_flags[addr] & CF_TARGET))
+	continue;
+      len = cjp_chain_length(addr);
+      for (i = 0; i < len; i++)
+	{
+	  cjp_test(a, & cjp);
+	  insn_constant(a, & value);
+	  if ((int16_t) value < lo)
+	    lo = value;
+	  if ((int16_t) value > hi)
+	    hi = value;
+	  a = read16(cjp + 1);
+	}
+      fprintf(f, "  %s %3d arms  constants %d..%d  density %.2f\n",
+	      code_name(addr, name, sizeof(name)), len, lo, hi, (double) len / ((int) hi - (int) lo + 1));
+      chains++;
+    }
+  if (! chains)
+    fprintf(f, "  none\n");
+}
+
+
+static int mix_count[0x81];
+
+static int mix_compare(const void *a, const void *b)
+{
+  return mix_count[*(const int *) b] - mix_count[*(const int *) a];
+}
+
+static void report_mix(FILE *f, int insns)
+{
+  int order[0x81];
+  int i;
+
+  memset(mix_count, 0, sizeof(mix_count));
+  for (i = 0; i < block_count; i++)
+    {
+      uint16_t a = blocks[i].start;
+      while (a < blocks[i].end)
+	{
+	  mix_count[mem[a] >= 0x80 ? 0x80 : mem[a]]++;
+	  a += insn_length(a);
+	}
+    }
+  for (i = 0; i <= 0x80; i++)
+    order[i] = i;
+  qsort(order, 0x81, sizeof(int), mix_compare);
+
+  fprintf(f, "\nstatic instruction mix:\n");
+  for (i = 0; (i <= 0x80) && mix_count[order[i]]; i++)
+    fprintf(f, "  %-10s %6d  %5.1f%%\n",
+	    order[i] == 0x80 ? "lod short" : op[order[i]].name,
+	    mix_count[order[i]], 100.0 * mix_count[order[i]] / insns);
+}
+
+
+void analyze_report(FILE *f)
+{
+  uint32_t addr;
+  int code_bytes = 0;
+  int insns = 0;
+  int procs = 0;
+  int subs = 0;
+  int bad = 0;
+  int i;
+
+  for (addr = CODE_START; addr < heap_start; addr++)
+    {
+      if (code_flags[addr] & CF_PROC)
+	procs++;
+      if (code_flags[addr] & CF_SUB)
+	subs++;
+      if (code_flags[addr] & CF_BAD)
+	bad++;
+    }
+  for (i = 0; i < block_count; i++)
+    {
+      code_bytes += blocks[i].end - blocks[i].start;
+      insns += blocks[i].insns;
+    }
+
+  fprintf(f, "image %04x-%04x: %d bytes, %d bytes of reachable code\n",
+	  CODE_START, heap_start - 1, heap_start - CODE_START, code_bytes);
+  fprintf(f, "%d instructions in %d basic blocks, %d procedures, %d subroutines\n",
+	  insns, block_count, procs, subs);
+  if (bad)
+    fprintf(f, "%d paths lead to invalid opcodes\n", bad);
+
+  report_calls(f);
+  report_loops(f);
+  report_cjp_chains(f);
+  report_mix(f, insns);
+}
@@ -0,0 +1,228 @@
+// I2L interpreter - exact per-procedure call profile
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// The call and return instructions maintain a shadow call stack, so
+// that every executed instruction is attributed to the procedure
+// (CAL target) or subroutine (JSR target) that executed it.
+// Inclusive counts of recursive procedures are only accumulated by
+// the outermost activation, so they are never counted twice.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+bool callprof;
+char *callprof_fn;
+char *callprof_sort = "incl";
+
+typedef struct
+{
+  uint64_t calls;
+  uint64_t incl;       // instructions including callees
+  uint64_t excl;       // instructions excluding callees
+  uint32_t active;     // current recursion depth
+  uint32_t max_depth;
+  uint32_t peak_heap;  // bytes of heap above hp at entry
+  bool jsr;
+} callprof_entry_t;
+
+typedef struct
+{
+  uint16_t target;
+  bool jsr;
+  uint16_t hp;           // hp at entry
+  uint16_t peak_hp;      // highest hp seen during the call
+  uint64_t start;        // insn_count at entry
+  uint64_t child_incl;   // instructions spent in callees
+} callprof_frame_t;
+
+#define CALLPROF_STACK_MAX 4096
+
+static callprof_entry_t *entries;  // indexed by target address
+static callprof_frame_t stack[CALLPROF_STACK_MAX];
+static int depth;
+static int excess;     // untracked frames above the shadow stack
+static uint64_t lost;  // calls too deep to track
+
+
+void callprof_enter(uint16_t target, bool jsr)
+{
+  callprof_entry_t *e = & entries[target];
+  callprof_frame_t *f;
+
+  if (depth == CALLPROF_STACK_MAX)
+    {
+      excess++;
+      lost++;
+      return;
+    }
+  if (depth)
+    {
+      f = & stack[depth - 1];
+      if (hp > f->peak_hp)
+	f->peak_hp = hp;
+    }
+
+  f = & stack[depth++];
+  f->target = target;
+  f->jsr = jsr;
+  f->hp = hp;
+  f->peak_hp = hp;
+  f->start = insn_count;
+  f->child_incl = 0;
+
+  e->calls++;
+  e->jsr = jsr;
+  if (++e->active > e->max_depth)
+    e->max_depth = e->active;
+}
+
+
+static void callprof_pop(void)
+{
+  callprof_frame_t *f = & stack[--depth];
+  callprof_entry_t *e = & entries[f->target];
+  uint64_t incl = insn_count - f->start;
+
+  if (hp > f->peak_hp)
+    f->peak_hp = hp;
+  if ((uint32_t) (f->peak_hp - f->hp) > e->peak_heap)
+    e->peak_heap = f->peak_hp - f->hp;
+
+  e->excl += incl - f->child_incl;
+  if (! --e->active)
+    e->incl += incl;
+
+  if (depth)
+    {
+      callprof_frame_t *parent = & stack[depth - 1];
+      parent->child_incl += incl;
+      if (f->peak_hp > parent->peak_hp)
+	parent->peak_hp = f->peak_hp;
+    }
+}
+
+
+// RET unwinds any JSR frames that weren't returned from, then its
+// own frame; RTS only unwinds a JSR frame.
+void callprof_leave(bool jsr)
+{
+  if (excess)
+    {
+      excess--;
+      return;
+    }
+  if (jsr)
+    {
+      if (depth && stack[depth - 1].jsr)
+	callprof_pop();
+      return;
+    }
+  while (depth && stack[depth - 1].jsr)
+    callprof_pop();
+  if (depth)
+    callprof_pop();
+}
+
+
+// Closes all open frames, at exit or on a restart.
+void callprof_unwind(void)
+{
+  excess = 0;
+  while (depth)
+    callprof_pop();
+}
+
+
+static const char *sort_names[] = { "calls", "incl", "excl", "depth", "heap" };
+#define SORT_KEYS (int) (sizeof(sort_names) / sizeof(sort_names[0]))
+
+static int sort_key;
+
+static uint64_t entry_key(const callprof_entry_t *e)
+{
+  switch (sort_key)
+    {
+    case 0: return e->calls;
+    case 1: return e->incl;
+    case 2: return e->excl;
+    case 3: return e->max_depth;
+    default: return e->peak_heap;
+    }
+}
+
+static int entry_compare(const void *a, const void *b)
+{
+  uint64_t ka = entry_key(& entries[*(const uint16_t *) a]);
+  uint64_t kb = entry_key(& entries[*(const uint16_t *) b]);
+  if (ka != kb)
+    return ka < kb ? 1 : -1;
+  return (int) *(const uint16_t *) a - (int) *(const uint16_t *) b;
+}
+
+
+void callprof_write(void)
+{
+  uint16_t *order;
+  int count = 0;
+  FILE *f;
+  char name[64];
+  int i;
+
+  callprof_unwind();
+
+  order = malloc(MAX_MEM * sizeof(uint16_t));
+  if (! order)
+    return;
+  for (i = 0; i < MAX_MEM; i++)
+    if (entries[i].calls)
+      order[count++] = i;
+  qsort(order, count, sizeof(uint16_t), entry_compare);
+
+  f = fopen(callprof_fn, "w");
+  if (! f)
+    {
+      fprintf(stderr, "%s: can't open call profile file %s\n", progname, callprof_fn);
+      free(order);
+      return;
+    }
+  fprintf(f, "# %" PRIu64 " instructions, sorted by %s\n", insn_count, sort_names[sort_key]);
+  fprintf(f, "%-20s %4s %12s %14s %14s %6s %6s %6s\n",
+	  "proc", "kind", "calls", "inclusive", "exclusive", "excl%", "depth", "heap");
+  for (i = 0; i < count; i++)
+    {
+      callprof_entry_t *e = & entries[order[i]];
+      fprintf(f, "%-20s %4s %12" PRIu64 " %14" PRIu64 " %14" PRIu64 " %6.2f %6" PRIu32 " %6" PRIu32 "\n",
+	      proc_name(order[i], name, sizeof(name)),
+	      e->jsr ? "jsr" : "cal",
+	      e->calls, e->incl, e->excl,
+	      insn_count ? 100.0 * e->excl / insn_count : 0.0,
+	      e->max_depth, e->peak_heap);
+    }
+  if (lost)
+    fprintf(f, "# %" PRIu64 " calls nested too deeply to be tracked\n", lost);
+  fclose(f);
+  free(order);
+}
+
+
+void callprof_start(void)
+{
+  for (sort_key = 0; sort_key < SORT_KEYS; sort_key++)
+    if (strcmp(callprof_sort, sort_names[sort_key]) == 0)
+      break;
+  if (sort_key == SORT_KEYS)
+    fatal_error(ERR_BAD_CMD_LINE, "unknown call profile sort key %s", callprof_sort);
+
+  entries = calloc(MAX_MEM, sizeof(callprof_entry_t));
+  if (! entries)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+  callprof = true;
+  atexit(callprof_write);
+}
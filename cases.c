@@ -0,0 +1,293 @@
+// I2L interpreter - case statement dispatch tables
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// A case statement compiles to a chain of tests, each a constant and
+// a CJP to the next test, with the case value left on the stack for
+// the arm that matches.  At load time the constant of the first test
+// of each chain is replaced by CJT, an internal instruction that
+// looks the case value up in a table and jumps straight to the arm
+// that the chain would have reached, or to the code following the
+// last test.  The rest of the chain is left alone, so a jump into
+// the middle of it still works.
+//
+// Chains with dense constants get a table indexed by value, others
+// an open addressed hash table.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+bool case_tables = true;
+
+typedef struct
+{
+  uint16_t min;         // smallest constant, for dense tables
+  uint32_t size;        // entries, a power of two for hash tables
+  int shift;            // hash tables only
+  bool dense;
+  uint16_t miss;        // target if no arm matches
+  uint16_t *values;     // hash tables only
+  uint16_t *targets;    // 0 for an empty entry
+} case_table_t;
+
+#define MAX_CASE_TABLES 256  // CJT has a one byte operand
+#define MIN_CASE_ARMS 2
+#define MAX_CASE_ARMS 4096
+
+static case_table_t case_table[MAX_CASE_TABLES];
+static int case_table_count;
+
+
+// Returns the address that the case chain with the given table
+// would reach for a case value.
+uint16_t case_jump(uint8_t index, uint16_t value)
+{
+  case_table_t *t;
+  uint16_t target;
+
+  if (index >= case_table_count)
+    fatal_error(ERR_BAD_OPCODE, "bad case table %" PRIu8, index);
+  t = & case_table[index];
+
+  if (t->dense)
+    {
+      uint32_t i = (uint16_t) (value - t->min);
+      target = (i < t->size) ? t->targets[i] : 0;
+    }
+  else
+    {
+      uint32_t i = (uint16_t) (value * 40503u) >> t->shift;
+      while ((target = t->targets[i]) && (t->values[i] != value))
+	i = (i + 1) & (t->size - 1);
+    }
+  return target ? target : t->miss;
+}
+
+
+static void hash_insert(case_table_t *t, uint16_t value, uint16_t target)
+{
+  uint32_t i = (uint16_t) (value * 40503u) >> t->shift;
+
+  while (t->targets[i])
+    {
+      if (t->values[i] == value)
+	return;  // an earlier arm has the same constant
+      i = (i + 1) & (t->size - 1);
+    }
+  t->values[i] = value;
+  t->targets[i] = target;
+}
+
+
+static void build_table(uint16_t head, int arms)
+{
+  case_table_t *t = & case_table[case_table_count];
+  uint16_t min = 0xffff, max = 0;
+  uint16_t addr, cjp, value;
+  int i;
+
+  addr = head;
+  for (i = 0; i < arms; i++)
+    {
+      (void) cjp_test(addr, & cjp);
+      (void) insn_constant(addr, & value);
+      if (value < min)
+	min = value;
+      if (value > max)
+	max = value;
+      addr = read16(cjp + 1);
+    }
+
+  memset(t, 0, sizeof(*t));
+  t->miss = addr;
+  if ((uint32_t) (max - min) < 4u * arms)
+    {
+      t->dense = true;
+      t->min = min;
+      t->size = max - min + 1;
+    }
+  else
+    for (t->size = 4, t->shift = 14; t->size < 2u * arms; t->size <<= 1)
+      t->shift--;
+  t->targets = calloc(t->size, sizeof(uint16_t));
+  t->values = t->dense ? NULL : calloc(t->size, sizeof(uint16_t));
+  if (! t->targets || (! t->dense && ! t->values))
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+
+  addr = head;
+  for (i = 0; i < arms; i++)
+    {
+      uint16_t arm;
+      (void) cjp_test(addr, & cjp);
+      (void) insn_constant(addr, & value);
+      arm = cjp + 3;
+      if (! t->dense)
+	hash_insert(t, value, arm);
+      else if (! t->targets[value - min])
+	t->targets[value - min] = arm;
+      addr = read16(cjp + 1);
+    }
+
+  mem[head] = 0x7f;  // CJT
+  mem[head + 1] = case_table_count++;
+}
+
+
+// Uses the code flags from analyze_code().
+void convert_cases(void)
+{
+  uint8_t *in_chain;
+  uint32_t addr;
+  uint16_t cjp;
+
+  if (! case_tables)
+    return;
+
+  // the first test of a chain isn't the target of another test
+  in_chain = calloc(MAX_MEM, 1);
+  if (! in_chain)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+  for (addr = CODE_START; addr < heap_start; addr++)
+    if (cjp_test(addr, & cjp))
+      in_chain[read16(cjp + 1)] = true;
+
+  for (addr = CODE_START; addr < heap_start; addr++)
+    {
+      int arms;
+
+      if (in_chain[addr] || ! cjp_test(addr, & cjp))
+	continue;
+      arms = cjp_chain_length(addr);
+      if ((arms < MIN_CASE_ARMS) || (arms > MAX_CASE_ARMS) ||
+	  (case_table_count == MAX_CASE_TABLES))
+	continue;
+      build_table(addr, arms);
+    }
+  free(in_chain);
+}
+
+
+// A table as stored in a shared code segment, followed by its targets
+// and, for a hash table, its values.
+typedef struct
+{
+  uint16_t min;
+  uint16_t miss;
+  uint32_t size;
+  int32_t shift;
+  uint32_t dense;
+} case_image_t;
+
+static size_t array_bytes(uint32_t size)
+{
+  return (size * sizeof(uint16_t) + 7) & ~(size_t) 7;
+}
+
+// Stores the tables at p, unless it's NULL, and returns their size.
+size_t cases_save(uint8_t *p)
+{
+  uint64_t count = case_table_count;
+  size_t n = 0;
+  int i;
+
+  if (p)
+    memcpy(p, & count, sizeof(count));
+  n += sizeof(count);
+  for (i = 0; i < case_table_count; i++)
+    {
+      case_table_t *t = & case_table[i];
+      case_image_t h = { t->min, t->miss, t->size, t->shift, t->dense };
+      if (p)
+	{
+	  memcpy(p + n, & h, sizeof(h));
+	  memcpy(p + n + sizeof(h), t->targets, t->size * sizeof(uint16_t));
+	}
+      n += sizeof(h) + array_bytes(t->size);
+      if (t->dense)
+	continue;
+      if (p)
+	memcpy(p + n, t->values, t->size * sizeof(uint16_t));
+      n += array_bytes(t->size);
+    }
+  return n;
+}
+
+// Points the tables at those stored by cases_save(), which must stay
+// mapped, instead of building them.
+void cases_attach(const uint8_t *p)
+{
+  uint64_t count;
+  size_t n = 0;
+  int i;
+
+  memcpy(& count, p, sizeof(count));
+  n += sizeof(count);
+  for (i = 0; i < (int) count; i++)
+    {
+      case_table_t *t = & case_table[i];
+      case_image_t h;
+      memcpy(& h, p + n, sizeof(h));
+      n += sizeof(h);
+      t->min = h.min;
+      t->miss = h.miss;
+      t->size = h.size;
+      t->shift = h.shift;
+      t->dense = h.dense;
+      t->targets = (uint16_t *) (p + n);
+      n += array_bytes(t->size);
+      t->values = NULL;
+      if (t->dense)
+	continue;
+      t->values = (uint16_t *) (p + n);
+      n += array_bytes(t->size);
+    }
+  case_table_count = count;
+}
+
+// True if the tables stored at p fit in len bytes and can be used by
+// case_jump(): each hash table the size its shift implies, with an
+// empty entry to end a search.
+bool cases_valid(const uint8_t *p, size_t len)
+{
+  uint64_t count;
+  size_t n = 0;
+  uint32_t i, j;
+
+  if (len < sizeof(count))
+    return false;
+  memcpy(& count, p, sizeof(count));
+  n += sizeof(count);
+  if (count > MAX_CASE_TABLES)
+    return false;
+  for (i = 0; i < count; i++)
+    {
+      case_image_t h;
+      uint16_t target;
+
+      if (len - n < sizeof(h))
+	return false;
+      memcpy(& h, p + n, sizeof(h));
+      n += sizeof(h);
+      if (h.dense ? ((h.size < 1) || (h.size > MAX_MEM)) :
+	  ((h.shift < 0) || (h.shift > 14) || (h.size != 1u << (16 - h.shift))))
+	return false;
+      if (len - n < array_bytes(h.size) * (h.dense ? 1 : 2))
+	return false;
+      for (j = 0; ! h.dense && (j < h.size); j++)
+	{
+	  memcpy(& target, p + n + j * sizeof(uint16_t), sizeof(target));
+	  if (! target)
+	    break;
+	}
+      if (! h.dense && (j == h.size))
+	return false;
+      n += array_bytes(h.size) * (h.dense ? 1 : 2);
+    }
+  return true;
+}
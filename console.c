@@ -0,0 +1,113 @@
+// I2L interpreter - raw console
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// Device 0 is the console as the terminal delivers it, a line at a
+// time with echo.  Device 1 is the same console raw: while a program
+// reads it, the terminal is switched out of canonical mode and echo,
+// so that each key is returned as soon as it's struck, by a blocking
+// read that costs no CPU while it waits.  Reading device 0 switches
+// back.  The terminal is restored at exit and on the signals that
+// would otherwise leave it raw.  CHKKEY says whether a key is waiting
+// without reading it, from what stdio has buffered and a poll() of
+// the console that returns at once; it switches to raw too, as a key
+// struck on a terminal in canonical mode isn't seen until Return.
+//
+// Output still buffered is flushed before any console read that would
+// block, and by CHKKEY when no key is waiting, so that a prompt is
+// always seen before the program waits.
+
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "i2l.h"
+
+
+static bool raw;
+static bool saved;
+static struct termios cooked;
+
+
+static void restore(void)
+{
+  if (raw)
+    tcsetattr(fileno(con_in), TCSANOW, & cooked);  // keeping typeahead
+  raw = false;
+}
+
+static void restore_and_raise(int sig)
+{
+  restore();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+
+// Switches the console to or from raw mode, if it's a terminal.
+void console_raw(bool on)
+{
+  struct termios t;
+  int fd;
+
+  if (on == raw)
+    return;
+  if (! on)
+    {
+      restore();
+      return;
+    }
+  if (! con_in || ((fd = fileno(con_in)) < 0) || ! isatty(fd))
+    return;
+  if (! saved)
+    {
+      if (tcgetattr(fd, & cooked))
+	return;
+      saved = true;
+      atexit(restore);
+      signal(SIGINT, restore_and_raise);
+      signal(SIGTERM, restore_and_raise);
+      signal(SIGHUP, restore_and_raise);
+      signal(SIGQUIT, restore_and_raise);
+    }
+  t = cooked;
+  t.c_lflag &= ~(ICANON | ECHO);
+  t.c_cc[VMIN] = 1;
+  t.c_cc[VTIME] = 0;
+  if (tcsetattr(fd, TCSANOW, & t) == 0)
+    raw = true;
+}
+
+
+// True if a console read wouldn't block.
+bool console_key_ready(void)
+{
+  struct pollfd p;
+
+  if (con_ready)
+    return con_ready('c');  // under the scheduler
+  if (! con_in)
+    return false;
+#ifdef __GLIBC__
+  if (con_in->_IO_read_ptr < con_in->_IO_read_end)
+    return true;
+#endif
+  p.fd = fileno(con_in);
+  p.events = POLLIN;
+  return (p.fd >= 0) && (poll(& p, 1, 0) == 1);
+}
+
+
+// Called before a console read.
+void console_before_read(void)
+{
+  if (con_out && __fpending(con_out) && ! console_key_ready())
+    fflush(con_out);
+}
@@ -0,0 +1,307 @@
+// I2L interpreter - run daemon
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// The daemon preloads a set of I2L programs, then forks a fixed pool
+// of worker processes which accept run requests on a Unix domain
+// socket.  Each worker is one VM: between requests the loaded image
+// is copied back into memory and interp() resets the registers, so
+// nothing is reloaded or reparsed.  With --vms, each worker instead
+// multiplexes many VMs; see sched.c.
+//
+// Request format, sent by the client:
+//   <program> [-i <input file>] [-o <output file>]\n
+// followed by whatever should be read from device 0.  <program> is
+// the name of a preloaded .i2l file without directory or extension.
+// Device 0 output, and any error message, is sent back over the
+// socket, which is closed when the program exits.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "i2l.h"
+
+
+char *daemon_socket_fn;
+int daemon_workers = 4;
+
+typedef struct
+{
+  char *name;
+  uint16_t heap_start;
+  vmem_t image;  // memory as the loader left it
+} program_t;
+
+static program_t *programs;
+static int program_count;
+
+const vmem_t *daemon_image;  // of the program last requested
+
+#define MAX_REQUEST 1024
+#define MAX_REQUEST_ARGS 8
+
+
+static void load_program(program_t *prog, char *fn)
+{
+  FILE *f;
+  char *base;
+  char *dot;
+
+  base = strrchr(fn, '/');
+  prog->name = strdup(base ? base + 1 : fn);
+  dot = strrchr(prog->name, '.');
+  if (dot)
+    *dot = '\0';
+
+  f = fopen(fn, "rb");
+  if (! f)
+    fatal_error(ERR_NO_I2L_FILE, "can't open %s", fn);
+  memset(mem, 0, MAX_MEM);
+  heap_start = 0;
+  loader(f);
+  fclose(f);
+  if (heap_limit <= heap_start)
+    fatal_error(ERR_BAD_CMD_LINE, "heap limit %04x is below the end of %s", heap_limit, fn);
+  analyze_code();
+  convert_cases();
+  convert_idioms();
+  convert_texts();
+
+  prog->heap_start = heap_start;
+  vmem_capture(& prog->image, NULL);
+}
+
+
+static program_t *find_program(char *name)
+{
+  int i;
+  for (i = 0; i < program_count; i++)
+    if (strcmp(programs[i].name, name) == 0)
+      return & programs[i];
+  return NULL;
+}
+
+
+// Put the VM back in the state the loader left it in.
+static void reset_program(program_t *prog)
+{
+  vmem_restore(& prog->image, NULL);
+  heap_start = prog->heap_start;
+  xmem_top = 0;
+  level = 0;
+  memset(display, 0, sizeof(display));
+  div_remainder = 0;
+}
+
+
+static void close_devices(void)
+{
+  if (disk_in_f)
+    {
+      fclose(disk_in_f);
+      disk_in_f = NULL;
+    }
+  if (disk_out_f)
+    {
+      fclose(disk_out_f);
+      disk_out_f = NULL;
+    }
+  disk_in_fn = NULL;
+  disk_out_fn = NULL;
+}
+
+
+// Reads the request line one byte at a time, so that nothing after
+// the newline is consumed; that belongs to device 0.
+static bool read_request(int fd, char *line, size_t size)
+{
+  size_t len = 0;
+
+  while (true)
+    {
+      char c;
+      ssize_t r = read(fd, & c, 1);
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r <= 0)
+	return false;
+      if (c == '\n')
+	break;
+      if (len >= size - 1)
+	return false;
+      line[len++] = c;
+    }
+  line[len] = '\0';
+  return true;
+}
+
+
+// Parses a request line and puts the VM in the state the loader left
+// the program in, with the device 3 files it names.  Returns false,
+// having told the client why, if the request is bad.
+bool daemon_request(char *line)
+{
+  char *arg[MAX_REQUEST_ARGS];
+  int argc = 0;
+  program_t *prog;
+  int i;
+
+  for (arg[argc] = strtok(line, " \t");
+       arg[argc] && (argc < MAX_REQUEST_ARGS - 1);
+       arg[argc] = strtok(NULL, " \t"))
+    argc++;
+
+  prog = argc ? find_program(arg[0]) : NULL;
+  if (! prog)
+    {
+      fprintf(con_out, "%s: unknown program\n", progname);
+      return false;
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      if ((strcmp(arg[i], "-i") == 0) && (i + 1 < argc))
+	disk_in_fn = arg[++i];
+      else if ((strcmp(arg[i], "-o") == 0) && (i + 1 < argc))
+	disk_out_fn = arg[++i];
+      else
+	{
+	  fprintf(con_out, "%s: bad request\n", progname);
+	  return false;
+	}
+    }
+
+  reset_program(prog);
+  daemon_image = & prog->image;
+  error_str[0] = '\0';
+  return true;
+}
+
+
+// Reports any error, then closes the devices and the console.
+void daemon_finish(void)
+{
+  if (error_str[0])
+    fprintf(con_out, "%s\n", error_str);
+  error_str[0] = '\0';
+
+  close_devices();
+  if (con_in)
+    fclose(con_in);
+  fclose(con_out);
+  con_in = NULL;
+  con_out = NULL;
+}
+
+
+static void serve_request(int conn)
+{
+  char line[MAX_REQUEST];
+
+  con_in = NULL;
+  con_out = fdopen(dup(conn), "w");
+  if (! con_out)
+    return;
+  error_str[0] = '\0';
+
+  if (! read_request(conn, line, sizeof(line)))
+    fprintf(con_out, "%s: bad request\n", progname);
+  else if (daemon_request(line) && (con_in = fdopen(dup(conn), "r")))
+    {
+      error_longjmp = true;
+      watchdog_start();
+      interp();
+      alarm(0);
+      error_longjmp = false;
+    }
+
+  daemon_finish();
+}
+
+
+static noreturn void worker(int sock)
+{
+  signal(SIGPIPE, SIG_IGN);
+
+  while (true)
+    {
+      int conn = accept(sock, NULL, NULL);
+      if (conn < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal_error(ERR_IO_ERROR, "accept failed on daemon socket");
+	}
+      serve_request(conn);
+      close(conn);
+    }
+}
+
+
+static pid_t start_worker(int sock)
+{
+  pid_t pid = fork();
+  if ((pid == 0) && (sched_vms > 1))
+    sched_worker(sock);
+  if (pid == 0)
+    worker(sock);
+  if (pid < 0)
+    fatal_error(ERR_INTERNAL_ERROR, "can't fork worker");
+  return pid;
+}
+
+
+noreturn void daemon_main(int count, char **fns)
+{
+  struct sockaddr_un addr;
+  int sock;
+  int i;
+
+  programs = calloc(count, sizeof(program_t));
+  if (! programs)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+  for (i = 0; i < count; i++)
+    load_program(& programs[program_count++], fns[i]);
+
+  if (strlen(daemon_socket_fn) >= sizeof(addr.sun_path))
+    fatal_error(ERR_BAD_CMD_LINE, "daemon socket name too long");
+  memset(& addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, daemon_socket_fn);
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    fatal_error(ERR_IO_ERROR, "can't create daemon socket");
+  unlink(daemon_socket_fn);
+  if (bind(sock, (struct sockaddr *) & addr, sizeof(addr)) < 0)
+    fatal_error(ERR_IO_ERROR, "can't bind daemon socket %s", daemon_socket_fn);
+  if (listen(sock, 64) < 0)
+    fatal_error(ERR_IO_ERROR, "can't listen on daemon socket");
+
+  fflush(stdout);
+  for (i = 0; i < daemon_workers; i++)
+    start_worker(sock);
+
+  // keep the pool at full strength
+  while (true)
+    {
+      int status;
+      pid_t pid = wait(& status);
+      if (pid < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal_error(ERR_INTERNAL_ERROR, "wait failed");
+	}
+      start_worker(sock);
+    }
+}
@@ -0,0 +1,57 @@
+// I2L interpreter - example native plugin
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// Build with "make demo/cksum.so", then run demo/cksum.i2l with
+// "i2l --plugin demo/cksum.so demo/cksum.i2l".  Provides
+//   'EXTERNAL' CKSUM=1;      CKSUM(Addr, Len) Fletcher-16 checksum
+//   'CODE' SORT=$3F;         SORT(Addr, Len) sorts bytes ascending
+// where Addr is a byte array, e.g. 'RESERVE'd.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+#include "../i2l_native.h"
+
+
+static void cksum(const i2l_native_api_t *api, void *ctx)
+{
+  (void) ctx;
+  uint16_t len = api->pop();
+  uint16_t addr = api->pop();
+  uint16_t a = 0, b = 0;
+
+  while (len--)
+    {
+      a = (a + api->mem[addr++]) % 255;
+      b = (b + a) % 255;
+    }
+  api->push((b << 8) | a);
+}
+
+
+static int compare(const void *a, const void *b)
+{
+  return *(const uint8_t *) a - *(const uint8_t *) b;
+}
+
+static void sort(const i2l_native_api_t *api, void *ctx)
+{
+  (void) ctx;
+  uint16_t len = api->pop();
+  uint16_t addr = api->pop();
+
+  if (addr + len > 0x10000)
+    len = 0x10000 - addr;
+  qsort(& api->mem[addr], len, 1, compare);
+}
+
+
+int i2l_plugin_init(const i2l_native_api_t *api)
+{
+  if (api->version != I2L_NATIVE_VERSION)
+    return -1;
+  if (api->register_external(1, "cksum", cksum, NULL))
+    return -1;
+  return api->register_intrinsic(0x3f, "sort", sort, NULL);
+}
@@ -0,0 +1,362 @@
+// I2L interpreter - lockstep comparison of execution engines
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// With --diff-engine the program is run by two engines at once: the
+// fast engine, which runs the code converted at load time by cases.c
+// and idioms.c, and the reference engine, which runs the code exactly
+// as it was loaded.  The reference engine is a child process forked
+// once the program is loaded.  It reads the input the fast engine
+// read, passed to it through a pipe in the format of a --record log,
+// and its output is discarded.
+//
+// The conversions change the number of instructions run, so the
+// engines can't be stopped at the same instruction count, but they
+// never change the procedure calls.  So the engines stop once every N
+// calls (--diff-every N, 1000 by default) and at exit, where the child
+// sends its registers and memory to the parent, which compares them
+// with its own, leaving out the bytes the conversions changed.  The
+// first difference is reported along with the last instructions each
+// engine ran.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "i2l.h"
+
+
+bool diff_engine;
+uint64_t diff_every = 1000;
+
+#define DIFF_WINDOW 16
+
+typedef struct
+{
+  uint64_t count;
+  uint16_t pc;
+  uint16_t sp;
+  uint16_t hp;
+  uint8_t code[3];
+} diff_insn_t;
+
+typedef struct
+{
+  uint64_t calls;
+  uint64_t insn_count;
+  bool done;        // at exit
+  int err;
+  bool trap;
+  uint16_t pc;
+  uint16_t sp;
+  uint16_t hp;
+  int level;
+  uint16_t display[MAX_LEVEL];
+  int16_t div_remainder;
+  int window_next;
+  diff_insn_t window[DIFF_WINDOW];
+  uint8_t mem[MAX_MEM];
+} diff_state_t;
+
+static bool reference;       // this is the child
+static bool stopped;         // a difference has been reported
+static pid_t child;
+static int sock;
+static uint64_t calls;
+static uint64_t next_check;
+static uint8_t *loaded;      // mem[] as loaded, before the conversions
+static uint8_t *converted;   // set for each byte the conversions changed
+static diff_insn_t window[DIFF_WINDOW];
+static int window_next;
+static diff_state_t ours, theirs;
+
+
+// Called for each instruction, before it runs.
+void diff_insn(uint16_t addr)
+{
+  diff_insn_t *w = & window[window_next];
+
+  w->count = insn_count;
+  w->pc = addr;
+  w->sp = sp;
+  w->hp = hp;
+  memcpy(w->code, & mem[addr], (addr <= MAX_MEM - 3) ? 3 : MAX_MEM - addr);
+  window_next = (window_next + 1) % DIFF_WINDOW;
+}
+
+
+static void get_state(diff_state_t *s, bool done)
+{
+  uint32_t addr;
+
+  s->calls = calls;
+  s->insn_count = insn_count;
+  s->done = done;
+  s->err = err;
+  s->trap = trap;
+  s->pc = pc;
+  s->sp = sp;
+  s->hp = hp;
+  s->level = level;
+  memcpy(s->display, display, sizeof(display));
+  s->div_remainder = div_remainder;
+  s->window_next = window_next;
+  memcpy(s->window, window, sizeof(window));
+  memcpy(s->mem, mem, MAX_MEM);
+#ifdef GUARD_STACK
+  save_stack(& s->mem[STACK_MIN]);
+#endif
+  for (addr = 0; addr < MAX_MEM; addr++)
+    if (converted[addr])
+      s->mem[addr] = 0;
+  // what's left below the stack pointer differs, as CJT doesn't push
+  // the constants of the tests it skips
+  memset(& s->mem[STACK_MIN], 0, sp + 1 - STACK_MIN);
+}
+
+
+static bool send_all(const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+
+  while (len)
+    {
+      ssize_t n = write(sock, p, len);
+      if (n <= 0)
+	return false;
+      p += n;
+      len -= n;
+    }
+  return true;
+}
+
+static bool recv_all(void *buf, size_t len)
+{
+  uint8_t *p = buf;
+
+  while (len)
+    {
+      ssize_t n = read(sock, p, len);
+      if (n <= 0)
+	return false;
+      p += n;
+      len -= n;
+    }
+  return true;
+}
+
+
+static void print_window(const char *engine, diff_state_t *s)
+{
+  int i;
+
+  fprintf(stderr, "  last instructions of the %s engine:\n", engine);
+  for (i = 0; i < DIFF_WINDOW; i++)
+    {
+      diff_insn_t *w = & s->window[(s->window_next + i) % DIFF_WINDOW];
+      uint8_t opcode = w->code[0];
+      int bytes = (opcode >= 0x80) ? 1 : class_bytes[op[opcode].class];
+      int j;
+
+      if (! w->count)
+	continue;
+      fprintf(stderr, "    %10" PRIu64 "  %04x: ", w->count, w->pc);
+      for (j = 0; j < 3; j++)
+	if (j < bytes)
+	  fprintf(stderr, "%02x ", w->code[j]);
+	else
+	  fprintf(stderr, "   ");
+      fprintf(stderr, " %-6s  sp: %04x  hp: %04x\n",
+	      (opcode >= 0x80) ? "lod" : op[opcode].name ? op[opcode].name : "???", w->sp, w->hp);
+    }
+}
+
+
+#define DIFFER(field) (ours.field != theirs.field)
+
+// Reports the first difference between the engines, if any.
+static bool compare(void)
+{
+  char name[64], ref_name[64];
+  uint32_t addr;
+  int i;
+
+  if (! DIFFER(done) && ! DIFFER(err) && ! DIFFER(trap) &&
+      ! DIFFER(pc) && ! DIFFER(sp) && ! DIFFER(hp) && ! DIFFER(level) &&
+      ! memcmp(ours.display, theirs.display, sizeof(ours.display)) &&
+      ! DIFFER(div_remainder) && ! memcmp(ours.mem, theirs.mem, MAX_MEM))
+    return true;
+
+  fprintf(stderr, "%s: the engines diverged by call %" PRIu64 ", at instruction %" PRIu64 " of the fast engine and %" PRIu64 " of the reference\n",
+	  progname, ours.calls, ours.insn_count, theirs.insn_count);
+  if (DIFFER(done))
+    fprintf(stderr, "  the %s engine has exited\n", ours.done ? "fast" : "reference");
+  if (DIFFER(err))
+    fprintf(stderr, "  error: fast %d, reference %d\n", ours.err, theirs.err);
+  if (DIFFER(trap))
+    fprintf(stderr, "  trap: fast %d, reference %d\n", ours.trap, theirs.trap);
+  if (DIFFER(pc))
+    fprintf(stderr, "  pc: fast %04x (%s), reference %04x (%s)\n", ours.pc, code_name(ours.pc, name, sizeof(name)),
+	    theirs.pc, code_name(theirs.pc, ref_name, sizeof(ref_name)));
+  if (DIFFER(sp))
+    fprintf(stderr, "  sp: fast %04x, reference %04x\n", ours.sp, theirs.sp);
+  if (DIFFER(hp))
+    fprintf(stderr, "  hp: fast %04x, reference %04x\n", ours.hp, theirs.hp);
+  if (DIFFER(level))
+    fprintf(stderr, "  level: fast %d, reference %d\n", ours.level, theirs.level);
+  for (i = 0; i < MAX_LEVEL; i++)
+    if (DIFFER(display[i]))
+      fprintf(stderr, "  display[%d]: fast %04x, reference %04x\n", i, ours.display[i], theirs.display[i]);
+  if (DIFFER(div_remainder))
+    fprintf(stderr, "  remainder: fast %04x, reference %04x\n",
+	    (uint16_t) ours.div_remainder, (uint16_t) theirs.div_remainder);
+  for (addr = 0; addr < MAX_MEM; addr++)
+    if (ours.mem[addr] != theirs.mem[addr])
+      {
+	int n = 0;
+	uint32_t a;
+	for (a = addr; a < MAX_MEM; a++)
+	  n += ours.mem[a] != theirs.mem[a];
+	fprintf(stderr, "  mem[%04x]: fast %02x, reference %02x, first of %d bytes that differ\n",
+		addr, ours.mem[addr], theirs.mem[addr], n);
+	break;
+      }
+  print_window("fast", & ours);
+  print_window("reference", & theirs);
+  return false;
+}
+
+
+// The reference sends its state and waits for the fast engine to
+// compare it; the fast engine gets the reference's state, once it has
+// passed the reference all the input read so far.
+static bool checkpoint(bool done)
+{
+  char ack = 0;
+
+  get_state(& ours, done);
+  if (reference)
+    return send_all(& ours, sizeof(ours)) && (done || recv_all(& ack, 1));
+
+  record_flush();
+  if (! recv_all(& theirs, sizeof(theirs)))
+    {
+      fprintf(stderr, "%s: the reference engine stopped by call %" PRIu64 "\n", progname, calls);
+      return false;
+    }
+  if (! compare())
+    return false;
+  return done || send_all(& ack, 1);
+}
+
+
+// Called by do_call() once the frame is built.
+void diff_call(void)
+{
+  if (++calls < next_check)
+    return;
+  next_check += diff_every;
+  if (checkpoint(false))
+    return;
+  if (reference)
+    _exit(0);  // the fast engine has reported the difference
+  stopped = true;
+  kill(child, SIGKILL);
+  fatal_error(ERR_INTERNAL_ERROR, "the engines diverged");
+}
+
+
+// At exit, which may be from a fatal error.
+static void diff_finish(void)
+{
+  int status;
+
+  if (reference)
+    {
+      (void) checkpoint(true);
+      return;
+    }
+  if (stopped)
+    return;
+  record_end();
+  if (! checkpoint(true))
+    {
+      fflush(stdout);
+      _exit(ERR_INTERNAL_ERROR);
+    }
+  close(sock);
+  waitpid(child, & status, 0);
+}
+
+
+// Called before the conversions.
+void diff_load(void)
+{
+  loaded = malloc(MAX_MEM);
+  converted = calloc(MAX_MEM, 1);
+  if (! loaded || ! converted)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+  memcpy(loaded, mem, MAX_MEM);
+}
+
+
+// Called after the conversions, forks the reference engine.
+void diff_start(void)
+{
+  int events[2];
+  int sv[2];
+  uint32_t addr;
+
+  for (addr = 0; addr < MAX_MEM; addr++)
+    converted[addr] = mem[addr] != loaded[addr];
+
+  if (pipe(events) || socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    fatal_error(ERR_INTERNAL_ERROR, "can't create pipes for --diff-engine");
+  fflush(stdout);
+  fflush(stderr);
+  child = fork();
+  if (child < 0)
+    fatal_error(ERR_INTERNAL_ERROR, "can't fork the reference engine");
+
+  if (! child)
+    {
+      reference = true;
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      close(events[1]);
+      close(sv[0]);
+      sock = sv[1];
+      memcpy(mem, loaded, MAX_MEM);
+      text_index = false;
+      replay_stream(fdopen(events[0], "r"));
+
+      // the fast engine does all the output
+      con_out = fopen("/dev/null", "w");
+      if (disk_out_fn)
+	disk_out_fn = "/dev/null";
+      tracef = NULL;
+      profile_fn = NULL;
+      callprof_fn = NULL;
+      perfctr_fn = NULL;
+      metrics_fn = NULL;
+      perfmap_file = false;
+      perfmap_jitdump = false;
+    }
+  else
+    {
+      close(events[0]);
+      close(sv[1]);
+      sock = sv[0];
+      record_stream(fdopen(events[1], "w"));
+      signal(SIGPIPE, SIG_IGN);  // a reference that stopped is reported
+    }
+  next_check = diff_every;
+  diff_engine = true;
+  atexit(diff_finish);
+}
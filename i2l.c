@@ -3,14 +3,19 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "i2l.h"
 
@@ -22,7 +27,7 @@ char error_str[81];
 
 uint16_t display[MAX_LEVEL];
 
-uint8_t mem[MAX_MEM];
+uint8_t mem[MAX_MEM] __attribute__((aligned(4096)));  // for --shared-code
 
 uint16_t heap_start;
 uint16_t heap_limit;
@@ -43,6 +48,22 @@ int err;
 
 int16_t div_remainder;
 
+uint64_t insn_count;
+uint64_t insn_limit = UINT64_MAX;
+unsigned int timeout_secs;
+static volatile sig_atomic_t watchdog_expired;
+
+yield_t yielded;
+uint64_t yield_count = UINT64_MAX;
+bool (*con_ready)(char conversion);
+static bool starting;  // interp_loop() starts the program over
+
+FILE *con_in;
+FILE *con_out;
+
+FILE *host_in[MAX_DEVICES];
+FILE *host_out[MAX_DEVICES];
+
 char *disk_in_fn;
 FILE *disk_in_f;
 
@@ -58,6 +79,8 @@ noreturn void v_fatal_error(int num, char *fmt, va_list ap)
   int i;
   
   err = num;
+  if (metrics && (num < METRICS_ERRORS))
+    metrics_errors[num]++;
   i = snprintf(error_str, sizeof(error_str), "%s: ", progname);
   if (fmt)
     vsnprintf(& error_str[i], sizeof(error_str) - i, fmt, ap);
@@ -91,6 +114,8 @@ void runtime_error(int num, char *fmt, ...)
   if ((num == ERR_IO_ERROR) && (! trap))
     {
       err = num;
+      if (metrics)
+	metrics_errors[num]++;
       return;
     }
 
@@ -100,63 +125,167 @@ void runtime_error(int num, char *fmt, ...)
 }
 
 
-static inline uint16_t read16(uint16_t addr)
+#ifdef GUARD_STACK
+// The evaluation stack has its own page, between two PROT_NONE
+// guard pages, so that overflow and underflow fault rather than
+// being checked by every push and pop.  Each byte of the stack takes
+// STACK_SCALE bytes of the page, so that the 256 bytes from STACK_MIN
+// fill it.  The stack thus holds one more byte than it does in mem[].
+#define GUARD_PAGE_SIZE 4096
+#define STACK_SCALE (GUARD_PAGE_SIZE / 256)
+static uint8_t stack_area[3 * GUARD_PAGE_SIZE] __attribute__((aligned(GUARD_PAGE_SIZE)));
+#define stack_page (& stack_area[GUARD_PAGE_SIZE])
+#define STACK_BYTE(addr) stack_page[((int) (addr) - STACK_MIN) * STACK_SCALE]
+// a pop must touch the stack even if the value is discarded
+#define STACK_POP(addr) (* (volatile uint8_t *) & STACK_BYTE(addr))
+#else
+#define STACK_BYTE(addr) mem[addr]
+#define STACK_POP(addr) mem[addr]
+#endif
+
+#ifdef GUARD_STACK
+// The scheduler saves the stack with the rest of a VM's memory.
+void save_stack(uint8_t *buf)
 {
-  return mem[addr] | (mem[addr+1] << 8);
+  for (int i = 0; i <= INITIAL_STACK - STACK_MIN; i++)
+    buf[i] = STACK_BYTE(STACK_MIN + i);
 }
 
-static inline void write16(uint16_t addr, uint16_t data)
+void restore_stack(const uint8_t *buf)
 {
-  mem[addr] = data & 0xff;
-  mem[addr+1] = data >> 8;
+  for (int i = 0; i <= INITIAL_STACK - STACK_MIN; i++)
+    STACK_BYTE(STACK_MIN + i) = buf[i];
 }
-
+#endif
 
 static inline uint16_t peek_tos16(void)
 {
-  uint16_t high = mem[sp+1] << 8;
-  uint16_t low = mem[sp+2];
+  uint16_t high = STACK_BYTE(sp+1) << 8;
+  uint16_t low = STACK_BYTE(sp+2);
   return high | low;
 }
 
 static inline uint16_t peek_nos16(void)
 {
-  uint16_t high = mem[sp+3] << 8;
-  uint16_t low = mem[sp+4];
+  uint16_t high = STACK_BYTE(sp+3) << 8;
+  uint16_t low = STACK_BYTE(sp+4);
   return high | low;
 }
 
 static inline uint8_t pop8(void)
 {
+#ifndef GUARD_STACK
   if (sp >= (INITIAL_STACK))
     fatal_error(ERR_STACK_UNDERFLOW, NULL);
-  return mem[++sp];
+#endif
+  return STACK_POP(++sp);
 }
 
 static inline uint16_t pop16(void)
 {
+#ifndef GUARD_STACK
   if (sp >= (INITIAL_STACK - 1))
     fatal_error(ERR_STACK_UNDERFLOW, NULL);
-  uint16_t high = mem[++sp] << 8;
-  return high | mem[++sp];
+#endif
+  uint16_t high = STACK_POP(++sp) << 8;
+  return high | STACK_POP(++sp);
 }
 
 static inline void push8(uint8_t value)
 {
+#ifndef GUARD_STACK
   if (sp < STACK_MIN + 1)
     fatal_error(ERR_STACK_OVERFLOW, NULL);
-  mem[sp--] = value;
+#endif
+  STACK_BYTE(sp--) = value;
 }
 
 static inline void push16(uint16_t value)
 {
+#ifndef GUARD_STACK
   if (sp < STACK_MIN + 2)
     fatal_error(ERR_STACK_OVERFLOW, NULL);
-  mem[sp--] = value & 0xff;
-  mem[sp--] = value >> 8;
+#endif
+  STACK_BYTE(sp--) = value & 0xff;
+  STACK_BYTE(sp--) = value >> 8;
+}
+
+// For native functions, which can't use the inline versions.
+uint16_t stack_pop(void)
+{
+  return pop16();
+}
+
+void stack_push(uint16_t value)
+{
+  push16(value);
+}
+
+// For the metrics, the stack is filled with a pattern, and the deepest
+// byte that doesn't hold it shows how much of the stack was used.
+#define STACK_PAINT 0xa5
+
+void stack_paint(void)
+{
+  for (int addr = STACK_MIN; addr <= INITIAL_STACK; addr++)
+    STACK_BYTE(addr) = STACK_PAINT;
+}
+
+int stack_high_water(void)
+{
+  int addr = STACK_MIN;
+  while ((addr <= INITIAL_STACK) && (STACK_BYTE(addr) == STACK_PAINT))
+    addr++;
+  return INITIAL_STACK + 1 - addr;
+}
+
+// For the trace, which shows the top two words even if the stack
+// doesn't hold that many.
+static uint16_t trace_peek16(uint16_t addr)
+{
+#ifdef GUARD_STACK
+  if (addr >= INITIAL_STACK)
+    return 0;
+#endif
+  return (STACK_BYTE(addr) << 8) | STACK_BYTE(addr + 1);
+}
+
+
+#ifdef GUARD_STACK
+static void guard_handler(int sig, siginfo_t *si, void *context)
+{
+  uint8_t *addr = si->si_addr;
+
+  (void) context;
+  if ((addr >= stack_area) && (addr < stack_page))
+    fatal_error(ERR_STACK_OVERFLOW, NULL);
+  if ((addr >= stack_page + GUARD_PAGE_SIZE) &&
+      (addr < stack_area + sizeof(stack_area)))
+    fatal_error(ERR_STACK_UNDERFLOW, NULL);
+
+  // not a guard page, so crash as usual once the handler returns
+  signal(sig, SIG_DFL);
 }
 
 
+static void guard_stack_init(void)
+{
+  struct sigaction sa;
+
+  if ((sysconf(_SC_PAGESIZE) != GUARD_PAGE_SIZE) ||
+      mprotect(stack_area, GUARD_PAGE_SIZE, PROT_NONE) ||
+      mprotect(stack_page + GUARD_PAGE_SIZE, GUARD_PAGE_SIZE, PROT_NONE))
+    fatal_error(ERR_INTERNAL_ERROR, "can't set up stack guard pages");
+
+  // SA_NODEFER, since the handler doesn't return when it longjmp()s
+  memset(& sa, 0, sizeof(sa));
+  sa.sa_sigaction = guard_handler;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigaction(SIGSEGV, & sa, NULL);
+}
+#endif
+
+
 static inline uint8_t heap_pop_8(void)
 {
   if (hp < (heap_start + 1))
@@ -176,14 +305,14 @@ static inline uint16_t heap_pop_16(void)
 
 static inline void heap_push_8(uint8_t value)
 {
-  if (sp >= (heap_limit - 1))
+  if (hp >= (heap_limit - 1))
     fatal_error(ERR_HEAP_OVERFLOW, NULL);
   mem[hp++] = value;
 }
 
 static inline void heap_push_16(uint16_t value)
 {
-  if (sp >= (heap_limit - 2))
+  if (hp >= (heap_limit - 2))
     fatal_error(ERR_HEAP_OVERFLOW, NULL);
   write16(hp, value);
   hp += 2;
@@ -213,6 +342,141 @@ static inline uint8_t fetch_level(void)
   return level;
 }
 
+// Only called on backward branches and calls, since a runaway
+// program can't avoid executing one of those.
+static inline void check_limits(void)
+{
+  if ((insn_count >= insn_limit) || watchdog_expired)
+    limit_expired();
+  if (insn_count >= yield_count)
+    {
+      // the instruction completes, and the scheduler gets control
+      // at the next boundary
+      yielded = YIELD_QUANTUM;
+      run = false;
+    }
+}
+
+// Under the scheduler, an input intrinsic that finds no console input
+// ready puts its device number back and backs up to its CML, then
+// yields; the CML runs again when the VM is resumed.  conversion is
+// 'c' for a character, or the scanf conversion of a number.
+static bool input_wait(uint16_t dev, char conversion)
+{
+  if ((dev > 1) || ! con_ready || con_ready(conversion))
+    return false;
+  if (watchdog_expired)
+    limit_expired();
+  push16(dev);
+  pc -= 2;
+  insn_count--;
+  yielded = YIELD_INPUT;
+  run = false;
+  return true;
+}
+
+// Stream an embedding host attached to the device, if any.
+static inline FILE *host_stream(FILE **streams, uint16_t dev)
+{
+  return (dev < MAX_DEVICES) ? streams[dev] : NULL;
+}
+
+// The host's stream for the device if it has attached one, else the
+// console or the disk file.
+static FILE *input_stream(uint16_t dev)
+{
+  FILE *f = host_stream(host_in, dev);
+  if (f)
+    return f;
+  if ((dev == 3) && disk_in_f)
+    return disk_in_f;
+  if (dev > 1)
+    {
+      record_error(dev);
+      runtime_error(ERR_IO_ERROR, "unimplemented device %d", dev);
+    }
+  return con_in;
+}
+
+static FILE *output_stream(uint16_t dev)
+{
+  static FILE *null_out;
+  FILE *f = host_stream(host_out, dev);
+  if (f)
+    return f;
+  if ((dev == 3) && disk_out_f)
+    return disk_out_f;
+  if (dev == 7)
+    {
+      if (! null_out)
+	null_out = fopen("/dev/null", "w");
+      if (null_out)
+	return null_out;
+    }
+  if (dev > 1)
+    runtime_error(ERR_IO_ERROR, "unimplemented device %d", dev);
+  return con_out;
+}
+
+// Before reading the console, raw for device 1, see console.c.
+static void console_read(uint16_t dev)
+{
+  console_raw(dev == 1);
+  console_before_read();
+}
+
+// Byte counts for the metrics.
+static inline void count_read(uint16_t dev, int count)
+{
+  if (metrics && (dev < MAX_DEVICES) && (count > 0))
+    metrics_read[dev] += count;
+}
+
+static inline void count_written(uint16_t dev, int count)
+{
+  if (metrics && (dev < MAX_DEVICES) && (count > 0))
+    metrics_written[dev] += count;
+}
+
+static void push_char(uint16_t dev, int c)
+{
+  if (c == EOF)
+    runtime_error(ERR_IO_ERROR, "end of file");
+  else
+    count_read(dev, 1);
+  if (c == '\n')
+    c = '\r';
+  push16(c);
+}
+
+// SIGALRM for --timeout interrupts a read that's waiting, which then
+// fails with EINTR, so a timeout isn't taken for end of file.
+static void check_interrupted(FILE *f)
+{
+  if (watchdog_expired)
+    {
+      clearerr(f);
+      limit_expired();
+    }
+}
+
+static void read_char(FILE *f, uint16_t dev)
+{
+  int c = fgetc(f);
+  check_interrupted(f);
+  if (recording)
+    record_input('c', dev, c, 1);
+  push_char(dev, c);
+}
+
+static void write_char(FILE *f, uint16_t dev, uint16_t c)
+{
+  if (fputc(c, f) == EOF)
+    runtime_error(ERR_IO_ERROR, "end of file");
+  else
+    count_written(dev, 1);
+}
+
 const uint8_t class_bytes[256] =
 {
   [CLASS_NO_OPERAND]            = 1,
@@ -273,8 +537,17 @@ void op_stx(void)
 }
 
 
+static inline void mark_heap(void)
+{
+  if (metrics && (hp > metrics_heap_high))
+    metrics_heap_high = hp;
+}
+
 void do_call(int new_level, uint16_t target)
 {
+  check_limits();
+  if (callprof)
+    callprof_enter(target, false);
   heap_push_8(level<<1);            // caller's level
   level = new_level;
   heap_push_16(display[level]);  // prev value of display of new level
@@ -282,6 +555,15 @@ void do_call(int new_level, uint16_t target)
   heap_push_8(0x00);             // caller's PC offset, not used
   display[level] = hp;
   pc = target;
+  if (metrics)
+    {
+      metrics_calls++;
+      mark_heap();
+    }
+  if (trace_calls)
+    trace_enter(target);
+  if (diff_engine)
+    diff_call();
 }
 
 // opcode 0x05: CAL call an I2L procedure
@@ -290,11 +572,15 @@ void op_cal(void)
   int new_level = fetch_level();
   uint16_t target = fetch16();
   do_call(new_level, target);
+  if (perfmap)
+    perfmap_call(target);
 }
 
 // opcode 0x06: RET return from I2L procedure
 void op_ret(void)
 {
+  if (callprof)
+    callprof_leave(false);
   hp = display[level];  // dispose any reserve()'d memory
   (void) heap_pop_8();  // discard caller's PC offset, not used
   pc = heap_pop_16();   // restore caller's PC
@@ -302,12 +588,21 @@ void op_ret(void)
   int old_level = heap_pop_8() >> 1; // restore caller's level
   display[level] = old_display;  // restore
   level = old_level;
+  if (perfmap_depth)
+    {
+      // end the nested interp_run() of perfmap_call()
+      perfmap_returned = true;
+      run = false;
+    }
 }
 
 // opcode 0x07: JMP jump to I2L code
 void op_jmp(void)
 {
-  pc = fetch16();
+  uint16_t target = fetch16();
+  if (target < pc)
+    check_limits();
+  pc = target;
 }
 
 // opcode 0x08: JPC jump if false
@@ -316,13 +611,21 @@ void op_jpc(void)
   uint16_t target = fetch16();
   uint16_t val = pop16();
   if (! val)
-    pc = target;
+    {
+      if (target < pc)
+	check_limits();
+      pc = target;
+    }
 }
 
 // opcode 0x09: HPI increment HP by operand
 void op_hpi(void)
 {
-  hp += fetch8();
+  uint8_t size = fetch8();
+  if ((hp + size) > heap_limit)  // --heap-limit ffff would let hp wrap
+    fatal_error(ERR_HEAP_OVERFLOW, NULL);
+  hp += size;
+  mark_heap();
 }
 
 // opcode 0x0a: ARG get procedure arguments
@@ -330,6 +633,8 @@ void op_arg(void)
 {
   uint8_t count = fetch8();
   int i;
+  if ((hp + 6 + count + 1) > heap_limit)
+    fatal_error(ERR_HEAP_OVERFLOW, NULL);
   // start at offset 6 into heap to leave room for frame
   for (i = 0; i <= count; i++)
     mem[hp+6+(count-i)] = pop8();
@@ -348,9 +653,12 @@ void op_cml(void)
   if ((inum < 0) || (inum >= INTRINSIC_MAX))
     fatal_error(ERR_BAD_INTRINSIC, NULL);
   opfn_t *fn = intrinsic[inum].fn;
+  if (metrics)
+    metrics_intrinsics[inum]++;
   if (! fn)
-    fatal_error(ERR_BAD_INTRINSIC, NULL);
-  fn();
+    native_intrinsic(inum);  // registered at run time, see native.c
+  else
+    fn();
 }
 
 // opcode 0x0d: ADD add
@@ -460,7 +768,8 @@ void op_for(void)
   uint16_t target = fetch16();
   int16_t value = pop16();
   int16_t limit = peek_tos16();
-  if ((limit - value) <= 0)
+  check_limits();
+  if (value > limit)
     {
       pop16();
       pc = target;
@@ -568,7 +877,7 @@ void op_cjp(void)
   uint16_t tos = pop16();
   uint16_t nos = peek_tos16();
   uint16_t target = fetch16();
-  if (tos == nos)
+  if (tos != nos)
     pc = target;
 }
 
@@ -576,19 +885,22 @@ void op_cjp(void)
 void op_jsr(void)
 {
   uint16_t target = fetch16();
-  if (tracef)
+  check_limits();
+  if (callprof)
+    callprof_enter(target, true);
+  if (tracing)
     {
       fprintf(tracef, "jsr target %04" PRIx16 "\n", target);
       fflush(tracef);
     }
   push16(pc);
-  if (tracef)
+  if (tracing)
     {
       fprintf(tracef, "jsr pushed\n");
       fflush(tracef);
     }
   pc = target;
-  if (tracef)
+  if (tracing)
     {
       fprintf(tracef, "pc is %" PRIx16 "\n", pc);
       fflush(tracef);
@@ -598,9 +910,35 @@ void op_jsr(void)
 // opcode 0x27: RTS short return
 void op_rts(void)
 {
+  if (callprof)
+    callprof_leave(true);
   pc = pop16();
 }
 
+// opcode 0x7e: FORB FOR of a byte array loop, internal, see idioms.c
+void op_forb(void)
+{
+  int16_t value = peek_tos16();
+  int16_t limit = peek_nos16();
+  if (! bulk_loop(pc - 1, value, limit))
+    {
+      op_for();
+      return;
+    }
+  // the loop has run, now exit it as FOR would
+  pc = fetch16();
+  pop16();
+  pop16();
+  check_limits();
+}
+
+// opcode 0x7f: CJT case jump table, internal, see cases.c
+void op_cjt(void)
+{
+  uint8_t index = fetch8();
+  pc = case_jump(index, peek_tos16());
+}
+
 // opcode 0x28: DRP discard TOS
 void op_drp(void)
 {
@@ -610,7 +948,7 @@ void op_drp(void)
 // opcode 0x29: ECL call external
 void op_ecl(void)
 {
-  fatal_error(ERR_UNIMPLEMENTED_OPCODE, NULL);
+  native_external(fetch16());
 }
 
 
@@ -627,8 +965,16 @@ void intrinsic_abs(void)
 void intrinsic_ran(void)
 {
   int16_t range = pop16();
-  int r = rand();
-  push16(r % range);
+  int r;
+  if (replaying)
+    {
+      push16(replay_ran(range));
+      return;
+    }
+  r = rand() % range;
+  if (recording)
+    record_input('r', range, r, 0);
+  push16(r);
 }
 
 // intrinsic 0x02: REM remainder
@@ -646,6 +992,7 @@ void intrinsic_reserve(void)
   if ((hp + size) > heap_limit)
     fatal_error(ERR_HEAP_OVERFLOW, NULL);
   hp += size;
+  mark_heap();
   push16(base);
 }
 
@@ -671,37 +1018,46 @@ void intrinsic_restart(void)
   uint16_t val = pop16();
   run = false;
   rerun = true;
+  if (metrics)
+    metrics_reruns++;
 }
 
 // intrinsic 0x07: CHIN
 void intrinsic_chin(void)
 {
   uint16_t dev = pop16();
-  int c;
+  FILE *f;
   
+  if (input_wait(dev, 'c'))
+    return;
+  if (server_pending)
+    server_checkpoint();
+
+  if (replaying && (dev != 7))
+    {
+      int c;
+      if (replay_input('c', dev, & c, NULL))
+	push_char(dev, c);
+      return;
+    }
+  if ((f = host_stream(host_in, dev)))
+    {
+      read_char(f, dev);
+      return;
+    }
   switch (dev)
     {
     case 0:  // console, cooked (line-oriented)
-      c = fgetc(stdin);
-      if (c == EOF)
-	runtime_error(ERR_IO_ERROR, "end of file");
-      if (c == '\n')
-	c = '\r';
-      push16(c);
-      return;  // always available
     case 1:  // console, unbuffered, raw (no echo)
-      break;
+      console_read(dev);
+      read_char(con_in, dev);
+      return;  // always available
     case 2:  // printer
       break;
     case 3:  // disk input file
       if (! disk_in_f)
 	break;
-      c = fgetc(disk_in_f);
-      if (c == EOF)
-	runtime_error(ERR_IO_ERROR, "end of file");
-      if (c == '\n')
-	c = '\r';
-      push16(c);
+      read_char(disk_in_f, dev);
       return;
     case 4:  // serial
       break;
@@ -709,6 +1065,7 @@ void intrinsic_chin(void)
       push16(XPL0_EOF);  // end of file
       return;  // always available
     }
+  record_error(dev);
   runtime_error(ERR_IO_ERROR, "can't read from device %d", dev);
 }
 
@@ -717,25 +1074,25 @@ void intrinsic_chout(void)
 {
   uint16_t c = pop16();
   uint16_t dev = pop16();
-  int r;
+  FILE *f;
   
+  if ((f = host_stream(host_out, dev)))
+    {
+      write_char(f, dev, c);
+      return;
+    }
   switch (dev)
     {
     case 0:  // console, cooked (line-oriented)
-      r = fputc(c, stdout);
-      if (r == EOF)
-	runtime_error(ERR_IO_ERROR, "end of file");
-      return;  // always available
     case 1:  // console, unbuffered, raw (no echo)
-      break;
+      write_char(con_out, dev, c);
+      return;  // always available
     case 2:  // printer
       break;
     case 3:  // disk input file
       if (! disk_out_f)
 	break;
-      r = fputc(c, disk_out_f);
-      if (r == EOF)
-	runtime_error(ERR_IO_ERROR, "end of file");
+      write_char(disk_out_f, dev, c);
       return;
     case 4:  // serial
       break;
@@ -750,19 +1107,36 @@ void intrinsic_chout(void)
 void intrinsic_crlf(void)
 {
   uint16_t dev = pop16();
-  if (dev != 0)
-    runtime_error(ERR_IO_ERROR, "unimplemented device %d", dev);
-  fprintf(stdout, "\n");
+  count_written(dev, fprintf(output_stream(dev), "\n"));
 }
 
 // intrinsic 0x0a: NUMIN
 void intrinsic_numin(void)
 {
   int16_t num;
+  int count = 0;
   uint16_t dev = pop16();
-  if (dev != 0)
-    runtime_error(ERR_IO_ERROR, "unimplemented device %d", dev);
-  fscanf(stdin, "%" SCNd16, & num);
+  if (input_wait(dev, 'd'))
+    return;
+  if (server_pending)
+    server_checkpoint();
+  if (replaying)
+    {
+      int value;
+      (void) replay_input('d', dev, & value, & count);
+      num = value;
+    }
+  else
+    {
+      FILE *f = input_stream(dev);
+      if (f == con_in)
+	console_read(dev);
+      fscanf(f, "%" SCNd16 "%n", & num, & count);
+      check_interrupted(f);
+      if (recording)
+	record_input('d', dev, num, count);
+    }
+  count_read(dev, count);
   // XXX should check for I/O error
   push16(num);
 }
@@ -772,41 +1146,32 @@ void intrinsic_numout(void)
 {
   int16_t num = pop16();
   uint16_t dev = pop16();
-  if (dev != 0)
-    runtime_error(ERR_IO_ERROR, "unimplemented device %d", dev);
-  fprintf(stdout, "%d", num);
+  count_written(dev, fprintf(output_stream(dev), "%d", num));
   // XXX should check for I/O error
 }
 
 // intrinsic 0x0c: TEXT
 void intrinsic_text(void)
 {
-  int r;
   uint16_t si = pop16();
   uint16_t dev = pop16();
-  if (dev != 0)
-    runtime_error(ERR_IO_ERROR, "unimplemented device %d", dev);
-  while (1)
-    {
-      uint8_t c = mem[si++];
-      r = fputc(c & 0x7f, stdout);
-      if (r == EOF)
-	runtime_error(ERR_IO_ERROR, "end of file");
-      if (c & 0x80)
-	break;
-    }
+  FILE *f = output_stream(dev);
+  const uint8_t *s;
+  size_t len = text_string(si, & s);  // see texts.c
+  if (fwrite(s, 1, len, f) != len)
+    runtime_error(ERR_IO_ERROR, "end of file");
+  count_written(dev, len);
 }
 
-// intrinsic 0x0d: OPENI
-void intrinsic_openi(void)
+static bool open_input(uint16_t dev)
 {
-  uint16_t dev = pop16();
+  if (host_stream(host_in, dev))
+    return true;
   switch (dev)
     {
     case 0:  // console, cooked (line-oriented)
-      return;  // always available
     case 1:  // console, unbuffered, raw (no echo)
-      break;
+      return true;  // always available
     case 2:  // printer
       break;
     case 3:  // disk input file
@@ -820,25 +1185,47 @@ void intrinsic_openi(void)
       disk_in_f = fopen(disk_in_fn, "r");
       if (! disk_in_f)
 	break;
-      return;
+      return true;
     case 4:  // serial
       break;
     case 7:  // null device
-      return;  // always available
+      return true;  // always available
+    }
+  return false;
+}
+
+// intrinsic 0x0d: OPENI
+void intrinsic_openi(void)
+{
+  uint16_t dev = pop16();
+  int failed;
+  if (server_pending)
+    server_checkpoint();
+  if (replaying)
+    (void) replay_input('o', dev, & failed, NULL);
+  else
+    {
+      failed = ! open_input(dev);
+      if (recording)
+	record_input('o', dev, failed, 0);
     }
-  runtime_error(ERR_IO_ERROR, "can't open input device %d", dev);
+  if (failed)
+    runtime_error(ERR_IO_ERROR, "can't open input device %d", dev);
 }
 
 // intrinsic 0x0e: OPENO
 void intrinsic_openo(void)
 {
   uint16_t dev = pop16();
+  if (server_pending)
+    server_checkpoint();
+  if (host_stream(host_out, dev))
+    return;
   switch(dev)
     {
     case 0:  // console, cooked (line-oriented)
-      return;  // always available
     case 1:  // console, unbuffered, raw (no echo)
-      break;
+      return;  // always available
     case 2:  // printer
       break;
     case 3:  // disk input file
@@ -865,12 +1252,13 @@ void intrinsic_openo(void)
 void intrinsic_close(void)
 {
   uint16_t dev = pop16();
+  if (host_stream(host_in, dev) || host_stream(host_out, dev))
+    return;
   switch (dev)
     {
     case 0:  // console, cooked (line-oriented)
-      return;  // always available
     case 1:  // console, unbuffered, raw (no echo)
-      break;
+      return;  // always available
     case 2:  // printer
       break;
     case 3:  // disk in and out files
@@ -927,7 +1315,11 @@ void intrinsic_gethp(void)
 // intrinsic 0x15: SETHP  // dangerous!
 void intrinsic_sethp(void)
 {
-  hp = pop16();
+  uint16_t new_hp = pop16();
+  if (new_hp > heap_limit)
+    fatal_error(ERR_HEAP_OVERFLOW, NULL);
+  hp = new_hp;
+  mark_heap();
 }
 
 // intrinsic 0x16: ERRFLG
@@ -955,10 +1347,29 @@ void intrinsic_setrun(void)
 void intrinsic_hexin(void)
 {
   uint16_t num;
+  int count = 0;
   uint16_t dev = pop16();
-  if (dev != 0)
-    runtime_error(ERR_IO_ERROR, "unimplemented device %d", dev);
-  fscanf(stdin, "%" SCNx16, & num);
+  if (input_wait(dev, 'x'))
+    return;
+  if (server_pending)
+    server_checkpoint();
+  if (replaying)
+    {
+      int value;
+      (void) replay_input('x', dev, & value, & count);
+      num = value;
+    }
+  else
+    {
+      FILE *f = input_stream(dev);
+      if (f == con_in)
+	console_read(dev);
+      fscanf(f, "%" SCNx16 "%n", & num, & count);
+      check_interrupted(f);
+      if (recording)
+	record_input('x', dev, num, count);
+    }
+  count_read(dev, count);
   // XXX should check for I/O error
   push16(num);
 }
@@ -968,12 +1379,27 @@ void intrinsic_hexout(void)
 {
   uint16_t num = pop16();
   uint16_t dev = pop16();
-  if (dev != 0)
-    runtime_error(ERR_IO_ERROR, "unimplemented device %d", dev);
-  fprintf(stdout, "%x", num);
+  count_written(dev, fprintf(output_stream(dev), "%x", num));
   // XXX should check for I/O error
 }
 
+// intrinsic 0x21: CHKKEY, true if a key has been struck, which is
+// left to be read, as by device 1
+void intrinsic_chkkey(void)
+{
+  int ready;
+  if (replaying)
+    (void) replay_input('k', 0, & ready, NULL);
+  else
+    {
+      console_read(1);
+      ready = console_key_ready();
+      if (recording)
+	record_input('k', 0, ready, 0);
+    }
+  push16(ready ? -1 : 0);
+}
+
 
 const opinfo_t op[128] =
   {
@@ -1039,6 +1465,8 @@ const opinfo_t op[128] =
     [0x3a] = { op_tri,    "tri",    CLASS_NO_OPERAND },  // FP equiv of DBI?
     [0x3b] = { op_stt,    "stt",    CLASS_NO_OPERAND },  // FP equiv of STD
 #endif
+    [0x7e] = { op_forb,   "forb",   CLASS_ADDRESS },          // internal
+    [0x7f] = { op_cjt,    "cjt",    CLASS_ONE_BYTE_OPERAND }, // internal
   };
 
 const intrinsic_info_t intrinsic[INTRINSIC_MAX] =
@@ -1072,6 +1500,10 @@ const intrinsic_info_t intrinsic[INTRINSIC_MAX] =
     [0x1a] = { "hexin",   intrinsic_hexin },
     [0x1b] = { "hexout",  intrinsic_hexout },
 
+#if ! APPLE_II_INTRINSICS && ! MSDOS_INTRINSICS
+    [0x21] = { "chkkey",  intrinsic_chkkey },  // numbered as on the PC
+#endif
+
 #ifdef APEX_INTRINSICS
     [0x18] = { "scan",    intrinsic_scan },
 
@@ -1194,6 +1626,10 @@ bool read_hex(FILE *f, int digits, bool non_hex_ok, uint16_t *value)
 
 int loader_debug = 0;
 
+// Set for the first byte of each word the loader relocated, so
+// that tools that move code know which words are addresses.
+uint8_t reloc[MAX_MEM];
+
 void loader(FILE *f)
 {
   uint16_t base = CODE_START;
@@ -1207,6 +1643,8 @@ void loader(FILE *f)
 	{
 	  if (loader_debug >= 2)
 	    printf("loading addr %04x data %02x\n", base + offset, value); 
+	  reloc[base+offset] = false;
+	  reloc[(uint16_t) (base+offset-1)] = false;
 	  mem[base+(offset++)] = value;
 	  if ((base+offset) > heap_start)
 	    heap_start = base+offset;
@@ -1228,17 +1666,20 @@ void loader(FILE *f)
 	      if (loader_debug >= 2)
 		printf("fixup addr %04x value %04x\n", base + value, base + offset); 
 	      write16(base+value, base+offset);
+	      reloc[base+value] = true;
 	      break;
 	    case '*':  // relative address
 	      (void) read_hex(f, 4, false, & value);
 	      if (loader_debug >= 2)
 		printf("loading addr %04x value %04x\n", base + offset, base + value); 
 	      write16(base+offset, base + value);
+	      reloc[base+offset] = true;
 	      offset += 2;
 	      if ((base+offset) > heap_start)
 		heap_start = base+offset;
 	      break;
-	    case '$':  // end of file marker
+	    case '$':  // end of file marker, maybe followed by a symbol map
+	      load_image_symbols(f);
 	      return;
 	    default:
 	      fatal_error(ERR_I2L_UNEXPECTED_CHAR, NULL);
@@ -1252,10 +1693,19 @@ void interp_run(void)
 {
   while (run)
     {
+#ifdef I2L_LIBRARY
+      // a host running a number of instructions gets exactly that many
+      if (insn_count >= yield_count)
+	{
+	  yielded = YIELD_QUANTUM;
+	  break;
+	}
+#endif
       uint16_t old_pc = pc;
       uint8_t class;
       uint8_t bytes;
       uint8_t opcode = fetch8();
+      insn_count++;
       if (opcode >= 0x80)
 	class = CLASS_NO_OPERAND; // short global load
       else
@@ -1264,10 +1714,15 @@ void interp_run(void)
       if (bytes == 0)
 	fatal_error(ERR_INTERNAL_ERROR, NULL);
 
-      if (tracef)
+      tracing = tracef && ((! trace_filtered) || trace_filter(old_pc));
+      if (diff_engine)
+	diff_insn(old_pc);
+      if (tracing)
 	{
 	  int i;
-	  fprintf(tracef, "  sp: %04x  tos: %04x  nos: %04x\n", sp, peek_tos16(), peek_nos16());
+	  if (trace_filtered)
+	    fprintf(tracef, "  count: %" PRIu64 "\n", insn_count);
+	  fprintf(tracef, "  sp: %04x  tos: %04x  nos: %04x\n", sp, trace_peek16(sp + 1), trace_peek16(sp + 3));
 	  fprintf(tracef, "  hp: %04x\n", hp);
 	  fprintf(tracef, "  level: %d  display: [", level);
 	  for (i = 0; i < 8; i++)
@@ -1282,7 +1737,13 @@ void interp_run(void)
 		  read16(display[level]+1),
 		  read16(display[level]+3));
 	  for (i = 0; i < 8; i++)
-	    fprintf(tracef, "  var(%02x)=%04x", i*2, read16(display[level]+i*2));
+	    {
+	      const char *global = level ? NULL : global_name(i*2);
+	      if (global)
+		fprintf(tracef, "  %s=%04x", global, read16(display[level]+i*2));
+	      else
+		fprintf(tracef, "  var(%02x)=%04x", i*2, read16(display[level]+i*2));
+	    }
 	  fprintf(tracef, "\n");
 	  fprintf(tracef, "%04x: ", old_pc);
 	  for (i = 0; i < 4; i++)
@@ -1301,13 +1762,23 @@ void interp_run(void)
 	      int inum = mem[old_pc + 1] - INTRINSIC_OFFSET;
 	      if ((inum < 0) || (inum >= INTRINSIC_MAX))
 		fprintf(tracef, " unknown");
-	      else
+	      else if (intrinsic[inum].name)
 		fprintf(tracef, " %s", intrinsic[inum].name);
+	      else
+		fprintf(tracef, " %s", native_intrinsic_name(inum));
+	    }
+	  if (have_symbols())
+	    {
+	      char name[64];
+	      fprintf(tracef, "  ; %s", code_name(old_pc, name, sizeof(name)));
 	    }
 	  fprintf(tracef, "\n");
 	  fflush(tracef);
 	}
-      
+
+      if (perfctr)
+	perfctr_begin();
+
       if (opcode >= 0x80)
 	{
 	  // short global load (short form of LOD)
@@ -1323,23 +1794,157 @@ void interp_run(void)
 	  else
 	    fn();
 	}
+
+      if (perfctr)
+	perfctr_end(opcode);
     }
 }
 
-void interp(void)
+// Writes the interpreter state and the chain of procedure frames,
+// for post-mortem use.
+void dump_state(FILE *f)
+{
+  frame_t frames[MAX_FRAMES];
+  int count;
+  int i;
+
+  fprintf(f, "instructions executed: %" PRIu64 "\n", insn_count);
+  fprintf(f, "pc: %04x  sp: %04x  hp: %04x  level: %d\n", pc, sp, hp, level);
+  fprintf(f, "display: [");
+  for (i = 0; i < MAX_LEVEL; i++)
+    fprintf(f, "%s%04" PRIx16, i ? " " : "", display[i]);
+  fprintf(f, "]\n");
+  count = walk_frames(frames, MAX_FRAMES);
+  for (i = 0; i < count; i++)
+    fprintf(f, "  #%d proc %04x level %d frame %04x return %04x\n",
+	    i, frames[i].proc, frames[i].level, frames[i].frame, frames[i].ret);
+  if (have_symbols())
+    {
+      char name[64];
+      fprintf(f, "pc is in %s\n", code_name(pc, name, sizeof(name)));
+      for (i = 0; i < count; i++)
+	{
+	  fprintf(f, "  #%d %s", i, proc_name(frames[i].proc, name, sizeof(name)));
+	  if (frames[i].ret != 0xffff)
+	    fprintf(f, " called from %s", code_name(frames[i].ret, name, sizeof(name)));
+	  fprintf(f, "\n");
+	}
+      fprintf(f, "globals:");
+      for (i = 0; i < 0x100; i += 2)
+	if (global_name(i))
+	  fprintf(f, " %s=%04x", global_name(i), read16(display[0] + i));
+      fprintf(f, "\n");
+    }
+  fflush(f);
+}
+
+// Walks the procedure frames built by do_call(), innermost first.
+// Doesn't modify anything, so it's safe to use from a signal handler.
+int walk_frames(frame_t *frames, int max)
+{
+  uint16_t d[MAX_LEVEL];
+  int l = level;
+  int count = 0;
+
+  memcpy(d, display, sizeof(d));
+  while (count < max)
+    {
+      uint16_t frame = d[l];
+      uint16_t ret;
+      if ((frame < heap_start + 6) || (frame > hp))
+	break;
+      ret = read16(frame - 3);
+      frames[count].level = l;
+      frames[count].frame = frame;
+      frames[count].ret = ret;
+      if (ret == 0xffff)
+	frames[count].proc = CODE_START;  // main program
+      else if ((ret >= CODE_START + 4) && (mem[ret - 4] == 0x05))  // CAL
+	frames[count].proc = read16(ret - 2);
+      else
+	frames[count].proc = 0;  // unknown
+      count++;
+      if (ret == 0xffff)
+	break;
+      d[l] = read16(frame - 5);
+      l = mem[frame - 6] >> 1;
+      if (l >= MAX_LEVEL)
+	break;
+    }
+  return count;
+}
+
+noreturn void limit_expired(void)
+{
+  FILE *f = tracef ? tracef : stderr;
+  bool timeout = watchdog_expired;
+
+  fprintf(f, "%s: %s\n", progname,
+	  timeout ? "timeout expired" : "instruction limit reached");
+  dump_state(f);
+  if (timeout)
+    fatal_error(ERR_TIMEOUT, "timeout expired at %04" PRIx16, pc);
+  fatal_error(ERR_INSTRUCTION_LIMIT, "instruction limit reached at %04" PRIx16, pc);
+}
+
+static void watchdog_handler(int sig)
+{
+  (void) sig;
+  watchdog_expired = 1;
+}
+
+// The scheduler keeps a deadline for each VM rather than using alarm().
+void watchdog_set(bool expired)
+{
+  watchdog_expired = expired;
+}
+
+// Starts counting instructions and time from zero.
+void watchdog_start(void)
+{
+  insn_count = 0;
+  watchdog_expired = 0;
+  if (timeout_secs)
+    {
+      struct sigaction sa;
+      memset(& sa, 0, sizeof(sa));
+      sa.sa_handler = watchdog_handler;
+      sigaction(SIGALRM, & sa, NULL);
+      alarm(timeout_secs);
+    }
+}
+
+// Calls fn, returning the number of any fatal error rather than
+// exiting, for the library.
+int catch_errors(void (*fn)(void))
 {
+  bool saved = error_longjmp;
+
   err = 0;
-  bool initialized = false;
+  error_longjmp = true;
+  if (! setjmp(fatal_error_jmp_buf))
+    fn();
+  error_longjmp = saved;
+  return err;
+}
 
+static void interp_loop(void)
+{
+  yielded = YIELD_NONE;
   do
     {
       // The following setjmp will return non-zero for
       // an untrapped I/O error.
-      if (! setjmp(fatal_error_jmp_buf))
+      if (setjmp(fatal_error_jmp_buf))
+	yielded = YIELD_NONE;
+      else if (starting)
 	{
 	  sp = INITIAL_STACK;
 	  hp = heap_start;
 
+	  if (callprof)
+	    callprof_unwind();
+
 	  level = 0;
 	  mem[0xffff] = 0;              // set up an exit opcode
 	  pc = 0xffff;
@@ -1350,17 +1955,36 @@ void interp(void)
 	  run = true;
 	  rerun = false;
 	  trap = true;
-
-	  initialized = true;
 	}
+      else
+	run = true;
 
-      interp_run();
+      starting = true;  // a restart begins again
+      if (perfmap)
+	perfmap_main();
+      else
+	interp_run();
     }
+  while (rerun && (yielded == YIELD_NONE));
+}
+
+// Starts the program from the beginning.
+void interp(void)
+{
+  err = 0;
+  starting = true;
+  interp_loop();
+}
 
-  while(rerun);
+// Continues a program that yielded, until it exits or yields again.
+void interp_resume(void)
+{
+  starting = false;
+  interp_loop();
 }
 
 
+#ifndef I2L_LIBRARY
 void cleanup(void)
 {
   if (disk_out_f)
@@ -1372,10 +1996,29 @@ void cleanup(void)
 }
 
 
+// The value of a numeric option, which must be a number from min to
+// max with nothing after it.
+static uint64_t number_arg(const char *s, uint64_t min, uint64_t max)
+{
+  char *end;
+  unsigned long long n;
+
+  errno = 0;
+  n = strtoull(s, & end, 0);
+  if (! isdigit((unsigned char) *s) || *end || errno || (n < min) || (n > max))
+    fatal_error(ERR_BAD_CMD_LINE, "bad number %s", s);
+  return n;
+}
+
+
 int main(int argc, char **argv)
 {
   error_longjmp = false;
-  char *i2lfn = NULL;
+  bool analyze = false;
+  bool optimize_image = false;
+  bool diff = false;
+  char **i2lfns = calloc(argc, sizeof(char *));
+  int i2lfn_count = 0;
   FILE *i2lf = NULL;
 
   heap_start = 0;  // will be set by loader
@@ -1385,6 +2028,9 @@ int main(int argc, char **argv)
 
   progname = argv[0];
 
+  con_in = stdin;
+  con_out = stdout;
+
   disk_in_fn = NULL;
   disk_in_f = NULL;
 
@@ -1397,37 +2043,207 @@ int main(int argc, char **argv)
     {
       if (argv[0][0] == '-')
 	{
-	  if ((strcmp(argv[0], "--trace") == 0) && (! tracef) && (argc--))
+	  if ((strcmp(argv[0], "--trace") == 0) && (! tracef) && (argc-- > 1))
 	    {
 	      tracef = fopen(*++argv, "wb");
 	      if (! tracef)
 		fatal_error(ERR_IO_ERROR, "can't open trace file");
 	    }
+	  else if ((strcmp(argv[0], "--trace-range") == 0) && (argc-- > 1))
+	    trace_add_range(*++argv);
+	  else if ((strcmp(argv[0], "--trace-proc") == 0) && (argc-- > 1))
+	    trace_add_proc(*++argv);
+	  else if ((strcmp(argv[0], "--trace-every") == 0) && (argc-- > 1))
+	    trace_every = number_arg(*++argv, 1, UINT64_MAX);
+	  else if ((strcmp(argv[0], "--trace-start") == 0) && (argc-- > 1))
+	    trace_first = number_arg(*++argv, 0, UINT64_MAX);
+	  else if ((strcmp(argv[0], "--trace-stop") == 0) && (argc-- > 1))
+	    trace_last = number_arg(*++argv, 0, UINT64_MAX);
 	  else if ((strcmp(argv[0], "-i") == 0) && (! disk_in_fn) && (argc--))
 	    disk_in_fn = *++argv;
 	  else if ((strcmp(argv[0], "-o") == 0) && (! disk_out_fn) && (argc--))
 	    disk_out_fn = *++argv;
+	  else if ((strcmp(argv[0], "--server") == 0) && (! server_socket_fn) && (argc-- > 1))
+	    server_socket_fn = *++argv;
+	  else if ((strcmp(argv[0], "--max-instructions") == 0) && (argc-- > 1))
+	    insn_limit = number_arg(*++argv, 1, UINT64_MAX);
+	  else if ((strcmp(argv[0], "--timeout") == 0) && (argc-- > 1))
+	    timeout_secs = number_arg(*++argv, 1, UINT_MAX);
+	  else if ((strcmp(argv[0], "--profile") == 0) && (! profile_fn) && (argc-- > 1))
+	    profile_fn = *++argv;
+	  else if ((strcmp(argv[0], "--profile-hz") == 0) && (argc-- > 1))
+	    profile_hz = number_arg(*++argv, 1, 10000);
+	  else if (strcmp(argv[0], "--profile-pc") == 0)
+	    profile_pc = true;
+	  else if ((strcmp(argv[0], "--call-profile") == 0) && (! callprof_fn) && (argc-- > 1))
+	    callprof_fn = *++argv;
+	  else if ((strcmp(argv[0], "--call-profile-sort") == 0) && (argc-- > 1))
+	    callprof_sort = *++argv;
+	  else if ((strcmp(argv[0], "--perf-counters") == 0) && (! perfctr_fn) && (argc-- > 1))
+	    perfctr_fn = *++argv;
+	  else if ((strcmp(argv[0], "--perf-counters-every") == 0) && (argc-- > 1))
+	    perfctr_every = number_arg(*++argv, 1, UINT64_MAX);
+	  else if ((strcmp(argv[0], "--heap-limit") == 0) && (argc-- > 1))
+	    {
+	      char *end;
+	      unsigned long limit = strtoul(*++argv, & end, 16);
+	      if ((end == *argv) || *end || (limit > 0xffff))
+		fatal_error(ERR_BAD_CMD_LINE, "bad heap limit %s", *argv);
+	      heap_limit = limit;
+	    }
+	  else if ((strcmp(argv[0], "--extended-memory") == 0) && (argc-- > 1))
+	    {
+	      uint64_t kb = number_arg(*++argv, 1, XMEM_MAX_PARAS * XMEM_PARAGRAPH / 1024);
+	      xmem_paras = kb * 1024 / XMEM_PARAGRAPH;
+	    }
+	  else if ((strcmp(argv[0], "--metrics") == 0) && (! metrics_fn) && (argc-- > 1))
+	    metrics_fn = *++argv;
+	  else if ((strcmp(argv[0], "--metrics-every") == 0) && (argc-- > 1))
+	    metrics_every = number_arg(*++argv, 1, UINT_MAX);
+	  else if (strcmp(argv[0], "--perf-map") == 0)
+	    perfmap_file = true;
+	  else if (strcmp(argv[0], "--jitdump") == 0)
+	    perfmap_jitdump = true;
+	  else if (strcmp(argv[0], "--analyze") == 0)
+	    analyze = true;
+	  else if (strcmp(argv[0], "--optimize") == 0)
+	    optimize_image = true;
+	  else if (strcmp(argv[0], "--no-case-tables") == 0)
+	    case_tables = false;
+	  else if (strcmp(argv[0], "--no-loop-idioms") == 0)
+	    loop_idioms = false;
+	  else if (strcmp(argv[0], "--no-text-index") == 0)
+	    text_index = false;
+	  else if (strcmp(argv[0], "--shared-code") == 0)
+	    shared_code = true;
+	  else if ((strcmp(argv[0], "--record") == 0) && (! record_fn) && (argc-- > 1))
+	    record_fn = *++argv;
+	  else if ((strcmp(argv[0], "--replay") == 0) && (! replay_fn) && (argc-- > 1))
+	    replay_fn = *++argv;
+	  else if (strcmp(argv[0], "--diff-engine") == 0)
+	    diff = true;
+	  else if ((strcmp(argv[0], "--diff-every") == 0) && (argc-- > 1))
+	    diff_every = number_arg(*++argv, 1, UINT64_MAX);
+	  else if ((strcmp(argv[0], "--symbols") == 0) && (argc-- > 1))
+	    load_symbols(*++argv);
+	  else if ((strcmp(argv[0], "--plugin") == 0) && (argc-- > 1))
+	    load_plugin(*++argv);
+	  else if ((strcmp(argv[0], "--daemon") == 0) && (! daemon_socket_fn) && (argc-- > 1))
+	    daemon_socket_fn = *++argv;
+	  else if ((strcmp(argv[0], "--workers") == 0) && (argc-- > 1))
+	    daemon_workers = number_arg(*++argv, 1, INT_MAX);
+	  else if ((strcmp(argv[0], "--vms") == 0) && (argc-- > 1))
+	    sched_vms = number_arg(*++argv, 1, INT_MAX);
+	  else if ((strcmp(argv[0], "--quantum") == 0) && (argc-- > 1))
+	    sched_quantum = number_arg(*++argv, 1, UINT64_MAX);
 	  else
 	    fatal_error(ERR_BAD_CMD_LINE, NULL);
 	}
-      else if (i2lfn == NULL)
-	i2lfn = argv[0];
       else
-	fatal_error(ERR_BAD_CMD_LINE, NULL);
+	i2lfns[i2lfn_count++] = argv[0];
     }
 
-  if (! i2lfn)
-    fatal_error(ERR_NO_I2L_FILE, NULL);
-  i2lf = fopen(i2lfn, "rb");
-  if (! i2lf)
+  if (! i2lfn_count)
     fatal_error(ERR_NO_I2L_FILE, NULL);
-  loader(i2lf);
-  fclose(i2lf);
 
+#ifdef GUARD_STACK
+  guard_stack_init();
+#endif
+
+  if (daemon_socket_fn && (perfmap_file || perfmap_jitdump))
+    fatal_error(ERR_BAD_CMD_LINE, "--perf-map and --jitdump can't be used with --daemon");
+  if ((daemon_socket_fn || server_socket_fn) && metrics_fn)
+    fatal_error(ERR_BAD_CMD_LINE, "--metrics can't be used with --daemon or --server");
+  if (shared_code && daemon_socket_fn)
+    fatal_error(ERR_BAD_CMD_LINE, "--shared-code can't be used with --daemon");
+  if ((record_fn || replay_fn) && (daemon_socket_fn || server_socket_fn))
+    fatal_error(ERR_BAD_CMD_LINE, "--record and --replay can't be used with --daemon or --server");
+  if (record_fn && replay_fn)
+    fatal_error(ERR_BAD_CMD_LINE, "--record and --replay can't be used together");
+  if (diff && (daemon_socket_fn || server_socket_fn || record_fn || replay_fn || shared_code))
+    fatal_error(ERR_BAD_CMD_LINE, "--diff-engine can't be used with --daemon, --server, --record, --replay or --shared-code");
+  // before the daemon starts, since its workers use it too
+  if (xmem_paras)
+    xmem_start();
+
+  if (daemon_socket_fn)
+    daemon_main(i2lfn_count, i2lfns);
+
+  // with --optimize, the second file is the output
+  if (i2lfn_count > (optimize_image ? 2 : 1))
+    fatal_error(ERR_BAD_CMD_LINE, NULL);
+  if (optimize_image && (i2lfn_count != 2))
+    fatal_error(ERR_BAD_CMD_LINE, "--optimize needs input and output files");
+  if (analyze || optimize_image)
+    shared_code = false;
+  if (shared_code)
+    shcode_load(i2lfns[0]);
+  else
+    {
+      i2lf = fopen(i2lfns[0], "rb");
+      if (! i2lf)
+	fatal_error(ERR_NO_I2L_FILE, NULL);
+      loader(i2lf);
+      fclose(i2lf);
+    }
+  if (heap_limit <= heap_start)
+    fatal_error(ERR_BAD_CMD_LINE, "heap limit %04x is below the end of the program", heap_limit);
+
+  if (analyze)
+    {
+      analyze_code();
+      analyze_report(stdout);
+      exit(0);
+    }
+
+  if (optimize_image)
+    {
+      optimize(i2lfns[1]);
+      exit(0);
+    }
+
+  if (! shared_code)
+    {
+      analyze_code();
+      if (diff)
+	diff_load();
+      convert_cases();
+      convert_idioms();
+      convert_texts();
+      if (diff)
+	diff_start();
+    }
+
+  if (server_socket_fn)
+    server_init();
+
+  if (profile_fn)
+    profile_start();
+
+  if (callprof_fn)
+    callprof_start();
+
+  if (tracef)
+    trace_start();
+
+  if (perfctr_fn)
+    perfctr_start();
+
+  if (perfmap_file || perfmap_jitdump)
+    perfmap_start();
+
+  if (metrics_fn)
+    metrics_start();
+
+  if (record_fn || replay_fn)
+    record_start();
+
+  watchdog_start();
   interp();
 
   exit(err);
 }
+#endif
 
 
 // I2L format:
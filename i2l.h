@@ -15,6 +15,17 @@ extern uint8_t mem[MAX_MEM];
 extern uint16_t heap_start;
 extern uint16_t heap_limit;
 
+static inline uint16_t read16(uint16_t addr)
+{
+  return mem[addr] | (mem[addr+1] << 8);
+}
+
+static inline void write16(uint16_t addr, uint16_t data)
+{
+  mem[addr] = data & 0xff;
+  mem[addr+1] = data >> 8;
+}
+
 
 #define REAL_SIZE 5
 #define FLOATING_POINT false
@@ -34,13 +45,17 @@ extern uint16_t hp;  // heap pointer
 extern bool run;
 extern bool rerun;
 
-extern bool trace;
+extern FILE *tracef;
 
 extern bool trap;
 extern int err;
 
 extern int16_t div_remainder;
 
+extern uint64_t insn_count;  // instructions executed
+extern uint64_t insn_limit;
+extern unsigned int timeout_secs;
+
 
 #define XPL0_EOF 0x1a
 
@@ -68,6 +83,7 @@ typedef struct
 } opinfo_t;
 
 extern const opinfo_t op[];
+extern const uint8_t class_bytes[256];
 
 typedef struct
 {
@@ -105,6 +121,334 @@ enum
   ERR_STACK_OVERFLOW,
   ERR_HEAP_UNDERFLOW,
   ERR_INTERNAL_ERROR,
+  ERR_INSTRUCTION_LIMIT,
+  ERR_TIMEOUT,
 };
 
+extern char *progname;
+
+extern bool error_longjmp;
+extern char error_str[81];
+
 void fatal_error(int num, char *fmt, ...);
+void runtime_error(int num, char *fmt, ...);
+int catch_errors(void (*fn)(void));
+
+
+extern FILE *con_in;
+extern FILE *con_out;
+
+#define MAX_DEVICES 8
+
+// streams an embedding host attached to devices, see libi2l.c
+extern FILE *host_in[MAX_DEVICES];
+extern FILE *host_out[MAX_DEVICES];
+
+extern char *disk_in_fn;
+extern FILE *disk_in_f;
+
+extern char *disk_out_fn;
+extern FILE *disk_out_f;
+
+
+typedef struct
+{
+  uint16_t proc;   // CAL target, or 0 if unknown
+  uint16_t ret;    // caller's PC, 0xffff for the main program
+  uint16_t frame;  // display value of the frame
+  int level;
+} frame_t;
+
+#define MAX_FRAMES 64
+
+int walk_frames(frame_t *frames, int max);
+void dump_state(FILE *f);
+noreturn void limit_expired(void);
+void watchdog_set(bool expired);
+void watchdog_start(void);
+
+uint16_t stack_pop(void);
+void stack_push(uint16_t value);
+void stack_paint(void);
+int stack_high_water(void);
+
+// GUARD_STACK builds only
+void save_stack(uint8_t *buf);
+void restore_stack(const uint8_t *buf);
+
+extern uint8_t reloc[MAX_MEM];
+
+void loader(FILE *f);
+void interp(void);
+void interp_resume(void);
+void interp_run(void);
+
+typedef enum
+{
+  YIELD_NONE,     // the program exited
+  YIELD_QUANTUM,  // yield_count reached
+  YIELD_INPUT,    // con_ready() returned false
+} yield_t;
+
+extern yield_t yielded;
+extern uint64_t yield_count;
+extern bool (*con_ready)(char conversion);
+
+
+// vmem.c
+#define VMEM_PAGE_SIZE 256
+#define VMEM_PAGES (MAX_MEM / VMEM_PAGE_SIZE)
+
+typedef struct
+{
+  uint8_t *page[VMEM_PAGES];  // NULL if the same as the base
+} vmem_t;
+
+void vmem_capture(vmem_t *pages, const vmem_t *base);
+void vmem_restore(const vmem_t *pages, const vmem_t *base);
+void vmem_free(vmem_t *pages);
+
+
+// server.c
+extern char *server_socket_fn;
+extern bool server_pending;
+
+void server_init(void);
+void server_checkpoint(void);
+
+
+// daemon.c
+extern char *daemon_socket_fn;
+extern int daemon_workers;
+
+extern const vmem_t *daemon_image;
+
+bool daemon_request(char *line);
+void daemon_finish(void);
+noreturn void daemon_main(int count, char **fns);
+
+
+// sched.c
+extern int sched_vms;
+extern uint64_t sched_quantum;
+
+noreturn void sched_worker(int sock);
+
+
+// symbols.c
+void load_symbols(char *fn);
+void load_image_symbols(FILE *f);
+void write_symbols(FILE *f, uint16_t (*remap)(uint16_t addr));
+bool have_symbols(void);
+const char *symbol_name(uint16_t addr);
+const char *global_name(uint16_t offset);
+int symbol_addrs(const char *name, uint16_t *addrs, int max);
+char *proc_name(uint16_t addr, char *buf, size_t size);
+char *code_name(uint16_t addr, char *buf, size_t size);
+
+
+// profile.c
+extern char *profile_fn;
+extern int profile_hz;
+extern bool profile_pc;
+
+void profile_start(void);
+void profile_write(void);
+
+
+// callprof.c
+extern bool callprof;
+extern char *callprof_fn;
+extern char *callprof_sort;
+
+void callprof_start(void);
+void callprof_enter(uint16_t target, bool jsr);
+void callprof_leave(bool jsr);
+void callprof_unwind(void);
+void callprof_write(void);
+
+
+// perfctr.c
+extern bool perfctr;
+extern char *perfctr_fn;
+extern uint64_t perfctr_every;
+
+void perfctr_start(void);
+void perfctr_begin(void);
+void perfctr_end(uint8_t opcode);
+void perfctr_write(void);
+
+
+// perfmap.c
+extern bool perfmap;
+extern bool perfmap_file;
+extern bool perfmap_jitdump;
+extern int perfmap_depth;
+extern bool perfmap_returned;
+
+void perfmap_start(void);
+void perfmap_call(uint16_t target);
+void perfmap_main(void);
+
+
+// xmem.c
+#define XMEM_PARAGRAPH 16
+#define XMEM_MAX_PARAS 0x10000  // 1M, as segment numbers are 16 bits
+
+extern uint8_t *xmem;
+extern uint32_t xmem_paras;
+extern uint32_t xmem_top;
+
+void xmem_start(void);
+
+
+// metrics.c
+#define METRICS_ERRORS (ERR_TIMEOUT + 1)
+
+extern bool metrics;
+extern char *metrics_fn;
+extern unsigned int metrics_every;
+extern uint64_t metrics_calls;
+extern uint64_t metrics_intrinsics[INTRINSIC_MAX];
+extern uint64_t metrics_read[MAX_DEVICES];
+extern uint64_t metrics_written[MAX_DEVICES];
+extern uint64_t metrics_reruns;
+extern uint64_t metrics_errors[METRICS_ERRORS];
+extern uint16_t metrics_heap_high;
+
+void metrics_start(void);
+void metrics_write(void);
+
+
+// record.c
+extern bool recording;
+extern bool replaying;
+extern char *record_fn;
+extern char *replay_fn;
+
+void record_input(char kind, uint16_t dev, int value, int bytes);
+void record_error(uint16_t dev);
+bool replay_input(char kind, uint16_t dev, int *value, int *bytes);
+int replay_ran(uint16_t range);
+void record_start(void);
+void record_stream(FILE *f);
+void record_flush(void);
+void record_end(void);
+void replay_stream(FILE *f);
+
+
+// console.c
+void console_raw(bool on);
+bool console_key_ready(void);
+void console_before_read(void);
+
+
+// diffeng.c
+extern bool diff_engine;
+extern uint64_t diff_every;
+
+void diff_insn(uint16_t addr);
+void diff_call(void);
+void diff_load(void);
+void diff_start(void);
+
+
+// trace.c
+extern bool tracing;         // the current instruction is traced
+extern bool trace_filtered;
+extern bool trace_calls;     // trace_enter() wants calls
+extern uint64_t trace_first;
+extern uint64_t trace_last;
+extern uint64_t trace_every;
+
+void trace_add_range(char *arg);
+void trace_add_proc(char *arg);
+void trace_start(void);
+void trace_enter(uint16_t target);
+bool trace_filter(uint16_t addr);
+
+
+// analyze.c
+enum
+{
+  CF_INSN   = 0x01,  // start of a reachable instruction
+  CF_LEADER = 0x02,  // start of a basic block
+  CF_PROC   = 0x04,  // CAL target, or start of main program
+  CF_SUB    = 0x08,  // JSR target
+  CF_TARGET = 0x10,  // JMP, JPC, FOR or CJP target
+  CF_BAD    = 0x20,  // invalid opcode reached
+};
+
+extern uint8_t code_flags[MAX_MEM];
+
+typedef struct
+{
+  uint16_t start;
+  uint16_t end;      // address following the block
+  uint16_t last;     // address of the last instruction
+  uint16_t proc;     // procedure or subroutine containing the block
+  int insns;
+  int nsucc;
+  uint16_t succ[2];  // successors within the procedure
+} block_t;
+
+extern block_t *blocks;
+extern int block_count;
+
+int insn_length(uint16_t addr);
+const char *insn_name(uint16_t addr);
+bool insn_target(uint16_t addr, uint16_t *target);
+bool insn_falls_through(uint16_t addr);
+bool insn_constant(uint16_t addr, uint16_t *value);
+bool cjp_test(uint16_t addr, uint16_t *cjp);
+int cjp_chain_length(uint16_t addr);
+int block_index(uint16_t addr);
+void analyze_code(void);
+void analyze_report(FILE *f);
+
+// shcode.c
+extern bool shared_code;
+
+void shcode_load(const char *fn);
+
+// optimize.c
+void optimize(char *out_fn);
+
+// cases.c
+extern bool case_tables;
+
+uint16_t case_jump(uint8_t index, uint16_t value);
+void convert_cases(void);
+size_t cases_save(uint8_t *p);
+void cases_attach(const uint8_t *p);
+bool cases_valid(const uint8_t *p, size_t len);
+
+// idioms.c
+extern bool loop_idioms;
+
+bool bulk_loop(uint16_t addr, int16_t first, int16_t last);
+void convert_idioms(void);
+size_t idioms_save(uint8_t *p);
+void idioms_attach(const uint8_t *p);
+bool idioms_valid(const uint8_t *p, size_t len);
+
+// texts.c
+extern bool text_index;
+
+size_t text_string(uint16_t addr, const uint8_t **s);
+void convert_texts(void);
+size_t texts_save(uint8_t *p);
+void texts_attach(const uint8_t *p);
+bool texts_valid(const uint8_t *p, size_t len);
+
+// native.c
+#include "i2l_native.h"
+
+extern const i2l_native_api_t native_api;
+
+int native_register_intrinsic(int num, const char *name, i2l_native_fn *fn, void *ctx);
+int native_register_external(uint16_t num, const char *name, i2l_native_fn *fn, void *ctx);
+const char *native_intrinsic_name(int num);
+void native_intrinsic(int num);
+void native_external(uint16_t num);
+void load_plugin(const char *fn);
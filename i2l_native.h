@@ -0,0 +1,46 @@
+// I2L interpreter - native function interface
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// Native functions can be registered for CML intrinsic numbers that
+// have no built-in intrinsic, and for ECL external procedure numbers
+// ('EXTERNAL' declarations in XPL0), by a program using libi2l or by
+// a plugin loaded with --plugin.  A native function takes its
+// arguments off the evaluation stack, last argument first, and pushes
+// a result if the XPL0 program uses it as a function.
+//
+// A plugin is a shared object which exports i2l_plugin_init().  It
+// calls back into the interpreter only through the api it is passed,
+// so the i2l executable needn't export any symbols.
+
+#ifndef I2L_NATIVE_H
+#define I2L_NATIVE_H
+
+#include <stdint.h>
+
+#define I2L_NATIVE_VERSION 1
+
+typedef struct i2l_native_api i2l_native_api_t;
+
+typedef void i2l_native_fn(const i2l_native_api_t *api, void *ctx);
+
+struct i2l_native_api
+{
+  int version;                                  // I2L_NATIVE_VERSION
+  uint8_t *mem;                                 // the 64 KiB I2L memory
+  uint16_t (*pop)(void);
+  void (*push)(uint16_t value);
+  uint16_t (*read16)(uint16_t addr);            // little-endian, as I2L
+  void (*write16)(uint16_t addr, uint16_t value);
+  void (*error)(int num, const char *msg);      // stops the program, doesn't return
+
+  // Both return 0, or -1 if the number is out of range or taken.
+  // Intrinsic numbers are as in 'CODE' declarations, 0 to 127.
+  int (*register_intrinsic)(int num, const char *name, i2l_native_fn *fn, void *ctx);
+  int (*register_external)(uint16_t num, const char *name, i2l_native_fn *fn, void *ctx);
+};
+
+// Registers the plugin's functions, returning 0, or non-zero if the
+// plugin can't be used.
+int i2l_plugin_init(const i2l_native_api_t *api);
+
+#endif // I2L_NATIVE_H
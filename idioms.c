@@ -0,0 +1,410 @@
+// I2L interpreter - byte array loop idioms
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// A FOR loop over a byte array compiles to
+//   L:  FOR exit      pops the index value, exits once it passes the limit
+//       <body>
+//       INC i         pushes the next index value
+//       JMP L
+// At load time the FOR of loops whose body is one of these idioms is
+// replaced by FORB, an internal instruction that runs the whole loop
+// with memset(), memmove() or memcmp():
+//   fill:     a(i) := constant or variable
+//   copy:     b(i) := a(i)
+//   compare:  if a(i) # b(i) then f := constant
+// When the arrays overlap the variables, the evaluation stack, the
+// loop itself, or (for a copy) each other in a way that a byte at a
+// time copy would notice, FORB runs the loop as FOR would.  The
+// instruction count is advanced by the number of instructions the
+// loop would have executed, so instruction limits are unaffected.
+//
+// The daemon loads several programs into the same memory, so each
+// idiom keeps a copy of its loop, and those at the same address in
+// different programs are chained.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+bool loop_idioms = true;
+
+typedef enum { IDIOM_FILL, IDIOM_COPY, IDIOM_COMPARE } idiom_kind_t;
+
+#define MAX_IDIOM_CODE 40
+
+typedef struct
+{
+  uint8_t level;
+  uint8_t offset;
+} var_t;
+
+typedef struct
+{
+  idiom_kind_t kind;
+  uint16_t start;       // address of the FOR
+  uint16_t end;         // address following the JMP
+  var_t index;
+  var_t src;            // array read, or filled for IDIOM_FILL
+  var_t dst;            // array written, or compared with src
+  var_t value;          // fill variable, or compare flag
+  bool constant;        // fill value is constant
+  uint16_t k;           // constant
+  uint16_t next;        // index + 1 of another idiom at the same address
+  uint8_t code[MAX_IDIOM_CODE];
+} idiom_t;
+
+#define MAX_IDIOMS 1024
+
+static idiom_t idioms[MAX_IDIOMS];
+static int idiom_count;
+static uint16_t *idiom_at;  // index + 1 by FOR address
+
+
+// LOD or short global load of a variable.
+static int load_var(uint16_t addr, var_t *v)
+{
+  if (mem[addr] == 0x01)  // LOD
+    {
+      v->level = mem[addr + 1];
+      v->offset = mem[addr + 2];
+      return 3;
+    }
+  if (mem[addr] >= 0x80)
+    {
+      v->level = 0;
+      v->offset = (mem[addr] & 0x7f) << 1;
+      return 1;
+    }
+  return 0;
+}
+
+
+// Instruction with a level and offset operand referring to v.
+static int var_insn(uint16_t addr, uint8_t opcode, var_t *v)
+{
+  if (mem[addr] != opcode)
+    return 0;
+  v->level = mem[addr + 1];
+  v->offset = mem[addr + 2];
+  return 3;
+}
+
+
+static bool same_var(var_t *a, var_t *b)
+{
+  return (a->level == b->level) && (a->offset == b->offset);
+}
+
+
+static bool valid_var(var_t *v)
+{
+  return ! (v->level & 1) && ((v->level >> 1) < MAX_LEVEL);
+}
+
+
+static int constant(uint16_t addr, uint16_t *value)
+{
+  if (! insn_constant(addr, value))
+    return 0;
+  return insn_length(addr);
+}
+
+
+// Matches the loop body starting at addr, which must be followed by
+// INC and JMP back to the FOR.
+static bool match_body(idiom_t *d, uint16_t addr)
+{
+  var_t i2;
+  uint16_t jpc = 0;
+  int n;
+
+  if (! (n = load_var(addr, & d->index)))
+    return false;
+  addr += n;
+
+  if ((n = load_var(addr, & i2)) && same_var(& i2, & d->index) &&
+      (mem[addr + n] == 0x02))  // LDX
+    {
+      // copy
+      addr += n;
+      addr += var_insn(addr, 0x02, & d->src);
+      if (! (n = var_insn(addr, 0x04, & d->dst)))  // STX
+	return false;
+      addr += n;
+      d->kind = IDIOM_COPY;
+    }
+  else if ((n = var_insn(addr, 0x02, & d->src)))  // LDX
+    {
+      // compare
+      addr += n;
+      if (! (n = load_var(addr, & i2)) || ! same_var(& i2, & d->index))
+	return false;
+      addr += n;
+      if (! (n = var_insn(addr, 0x02, & d->dst)))
+	return false;
+      addr += n;
+      if ((mem[addr] != 0x13) || (mem[addr + 1] != 0x08))  // NE, JPC
+	return false;
+      jpc = read16(addr + 2);
+      addr += 4;
+      if (! (n = constant(addr, & d->k)))
+	return false;
+      addr += n;
+      if (! (n = var_insn(addr, 0x03, & d->value)) ||  // STO
+	  same_var(& d->value, & d->index))
+	return false;
+      addr += n;
+      if (jpc != addr)
+	return false;
+      d->kind = IDIOM_COMPARE;
+    }
+  else
+    {
+      // fill
+      if ((n = constant(addr, & d->k)))
+	d->constant = true;
+      else if (! (n = load_var(addr, & d->value)) || same_var(& d->value, & d->index))
+	return false;
+      addr += n;
+      if (! (n = var_insn(addr, 0x04, & d->src)))  // STX
+	return false;
+      addr += n;
+      d->kind = IDIOM_FILL;
+    }
+
+  if (! var_insn(addr, 0x19, & i2) || ! same_var(& i2, & d->index))  // INC
+    return false;
+  addr += 3;
+  if ((mem[addr] != 0x07) || (read16(addr + 1) != d->start))  // JMP
+    return false;
+  d->end = addr + 3;
+  if (d->end - d->start > MAX_IDIOM_CODE)
+    return false;
+
+  return valid_var(& d->index) && valid_var(& d->src) &&
+    ((d->kind == IDIOM_FILL) || valid_var(& d->dst)) &&
+    ((d->kind == IDIOM_COPY) || (d->kind == IDIOM_FILL && d->constant) ||
+     valid_var(& d->value));
+}
+
+
+// Uses the code flags from analyze_code().
+void convert_idioms(void)
+{
+  uint32_t addr;
+
+  if (! loop_idioms)
+    return;
+  if (! idiom_at)
+    idiom_at = calloc(MAX_MEM, sizeof(uint16_t));
+  if (! idiom_at)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+
+  for (addr = CODE_START; addr < heap_start; addr++)
+    {
+      idiom_t *d = & idioms[idiom_count];
+
+      if (! (code_flags[addr] & CF_INSN) || (mem[addr] != 0x18))  // FOR
+	continue;
+      if (idiom_count == MAX_IDIOMS)
+	break;
+      memset(d, 0, sizeof(*d));
+      d->start = addr;
+      if (! match_body(d, addr + 3))
+	continue;
+      mem[addr] = 0x7e;  // FORB
+      memcpy(d->code, & mem[addr], d->end - d->start);
+      d->next = idiom_at[addr];
+      idiom_at[addr] = ++idiom_count;
+    }
+}
+
+
+static uint16_t var_addr(var_t *v)
+{
+  return display[v->level >> 1] + v->offset;
+}
+
+
+static bool overlaps(uint32_t a, uint32_t a_len, uint32_t b, uint32_t b_len)
+{
+  return (a < b + b_len) && (b < a + a_len);
+}
+
+
+// The region [base, base+len) must not hold any variable the loop
+// uses, the evaluation stack, or the loop itself.
+static bool region_ok(idiom_t *d, uint32_t base, uint32_t len, bool written)
+{
+  if (base + len > MAX_MEM)
+    return false;
+  if (overlaps(base, len, var_addr(& d->index), 2))
+    return false;
+  if ((d->kind != IDIOM_COPY) && ! d->constant &&
+      overlaps(base, len, var_addr(& d->value), 2))
+    return false;
+  if (! written)
+    return true;
+  return ! overlaps(base, len, var_addr(& d->src), 2) &&
+    ((d->kind == IDIOM_FILL) || ! overlaps(base, len, var_addr(& d->dst), 2)) &&
+    ! overlaps(base, len, 0x100, 0x100) &&
+    ! overlaps(base, len, d->start, d->end - d->start);
+}
+
+
+// Runs the loop whose FOR is at addr for index values first..last,
+// if it is safe to do so.  Returns false if the FOR instruction
+// should be executed normally instead.
+bool bulk_loop(uint16_t addr, int16_t first, int16_t last)
+{
+  idiom_t *d;
+  uint32_t len, src, dst;
+  uint64_t insns;
+  uint64_t limit = insn_limit;
+  uint16_t i;
+
+#ifdef I2L_LIBRARY
+  // a host running a number of instructions gets exactly that many
+  if (yield_count < limit)
+    limit = yield_count;
+#endif
+
+  if (! idiom_at || tracef ||
+      (first < 0) || (first > last) || (last == INT16_MAX))
+    return false;
+  for (i = idiom_at[addr]; i; i = d->next)
+    {
+      d = & idioms[i - 1];
+      if (memcmp(& mem[addr], d->code, d->end - d->start) == 0)
+	break;
+    }
+  if (! i)
+    return false;
+  if (read16(var_addr(& d->index)) != (uint16_t) first)
+    return false;
+  len = last - first + 1;
+  src = read16(var_addr(& d->src)) + first;
+
+  switch (d->kind)
+    {
+    case IDIOM_FILL:
+      insns = 6 * (uint64_t) len;
+      if ((insn_count + insns > limit) || ! region_ok(d, src, len, true))
+	return false;
+      memset(& mem[src], d->constant ? d->k : mem[var_addr(& d->value)], len);
+      break;
+
+    case IDIOM_COPY:
+      dst = read16(var_addr(& d->dst)) + first;
+      insns = 7 * (uint64_t) len;
+      if ((insn_count + insns > limit) ||
+	  ! region_ok(d, src, len, false) || ! region_ok(d, dst, len, true) ||
+	  ((dst > src) && (dst < src + len)))  // a byte at a time copy repeats
+	return false;
+      memmove(& mem[dst], & mem[src], len);
+      break;
+
+    case IDIOM_COMPARE:
+      dst = read16(var_addr(& d->dst)) + first;
+      insns = 9 * (uint64_t) len;
+      if (! region_ok(d, src, len, false) || ! region_ok(d, dst, len, false))
+	return false;
+      if (memcmp(& mem[src], & mem[dst], len) != 0)
+	for (uint32_t i = 0; i < len; i++)
+	  if (mem[src + i] != mem[dst + i])
+	    insns += 2;
+      if (insn_count + insns > limit)
+	return false;
+      if (insns > 9 * (uint64_t) len)
+	write16(var_addr(& d->value), d->k);
+      break;
+    }
+
+  write16(var_addr(& d->index), last + 1);
+  insn_count += insns;
+  return true;
+}
+
+
+// Stores the idioms and their index at p, unless it's NULL, and
+// returns their size.
+size_t idioms_save(uint8_t *p)
+{
+  uint64_t count = idiom_at ? idiom_count + 1 : 0;  // 0 if not converted
+  size_t n = 0;
+
+  if (p)
+    memcpy(p, & count, sizeof(count));
+  n += sizeof(count);
+  if (! idiom_at)
+    return n;
+  if (p)
+    memcpy(p + n, idiom_at, MAX_MEM * sizeof(uint16_t));
+  n += MAX_MEM * sizeof(uint16_t);
+  if (p)
+    memcpy(p + n, idioms, idiom_count * sizeof(idiom_t));
+  n += idiom_count * sizeof(idiom_t);
+  return n;
+}
+
+// Uses the idioms stored by idioms_save(), whose index must stay
+// mapped, instead of converting them.
+void idioms_attach(const uint8_t *p)
+{
+  uint64_t count;
+
+  memcpy(& count, p, sizeof(count));
+  if (! count)
+    return;
+  idiom_count = count - 1;
+  idiom_at = (uint16_t *) (p + sizeof(count));
+  memcpy(idioms, p + sizeof(count) + MAX_MEM * sizeof(uint16_t), idiom_count * sizeof(idiom_t));
+}
+
+// True if the idioms stored at p fit in len bytes and can be used by
+// bulk_loop(): each is at the address whose chain holds it, in only
+// that chain.
+bool idioms_valid(const uint8_t *p, size_t len)
+{
+  uint64_t count;
+  uint8_t seen[MAX_IDIOMS] = { 0 };
+  const uint8_t *at, *list;
+  uint16_t j;
+  idiom_t d;
+  uint32_t addr;
+
+  if (len < sizeof(count))
+    return false;
+  memcpy(& count, p, sizeof(count));
+  if (! count)
+    return true;
+  count--;
+  if ((count > MAX_IDIOMS) ||
+      (len - sizeof(count) < MAX_MEM * sizeof(uint16_t) + count * sizeof(idiom_t)))
+    return false;
+  at = p + sizeof(count);
+  list = at + MAX_MEM * sizeof(uint16_t);
+  for (addr = 0; addr < MAX_MEM; addr++)
+    {
+      memcpy(& j, at + addr * sizeof(uint16_t), sizeof(j));
+      for (; j; j = d.next)
+	{
+	  if ((j > count) || seen[j - 1])
+	    return false;
+	  seen[j - 1] = true;
+	  memcpy(& d, list + (j - 1) * sizeof(idiom_t), sizeof(d));
+	  if ((d.start != addr) || (d.kind > IDIOM_COMPARE) ||
+	      (d.end <= d.start) || (d.end - d.start > MAX_IDIOM_CODE) ||
+	      ! valid_var(& d.index) || ! valid_var(& d.src) ||
+	      ! valid_var(& d.dst) || ! valid_var(& d.value))
+	    return false;
+	}
+    }
+  return true;
+}
@@ -0,0 +1,329 @@
+// I2L interpreter - library interface
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// See libi2l.h.  The library objects are compiled with I2L_LIBRARY
+// defined, which leaves main() out of i2l.c and makes the interpreter
+// stop exactly at yield_count, so that i2l_run() never runs more
+// instructions than it was asked to.  Fatal errors longjmp back to
+// the library call, and devices with host callbacks are cookie
+// streams in host_in[] and host_out[].
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+#include "libi2l.h"
+
+
+typedef struct
+{
+  int dev;
+  i2l_read_fn *read;
+  i2l_write_fn *write;
+  void *ctx;
+} device_t;
+
+static device_t devices[MAX_DEVICES];
+
+static bool initialized;
+static bool loaded;
+static bool started;  // and can be resumed
+static FILE *load_f;
+
+
+// Same defaults as the i2l command.
+static void init(void)
+{
+  if (initialized)
+    return;
+  progname = "i2l";
+  heap_limit = 0x5fff;
+  con_in = stdin;
+  con_out = stdout;
+  initialized = true;
+}
+
+
+static void load(void)
+{
+  memset(mem, 0, MAX_MEM);
+  heap_start = 0;
+  level = 0;
+  memset(display, 0, sizeof(display));
+  div_remainder = 0;
+  xmem_top = 0;
+  loader(load_f);
+  if (heap_limit <= heap_start)
+    fatal_error(ERR_BAD_CMD_LINE, "heap limit %04x is below the end of the program", heap_limit);
+  analyze_code();
+  convert_cases();
+  convert_idioms();
+  convert_texts();
+}
+
+
+static int load_stream(FILE *f)
+{
+  int r;
+
+  loaded = false;
+  started = false;
+  load_f = f;
+  r = catch_errors(load);
+  fclose(f);
+  if (r)
+    return r;
+  loaded = true;
+  return I2L_OK;
+}
+
+
+int i2l_load_file(const char *fn)
+{
+  FILE *f;
+
+  init();
+  error_str[0] = '\0';
+  f = fopen(fn, "rb");
+  if (! f)
+    {
+      snprintf(error_str, sizeof(error_str), "%s: can't open %s", progname, fn);
+      return ERR_NO_I2L_FILE;
+    }
+  return load_stream(f);
+}
+
+
+int i2l_load_mem(const void *image, size_t size)
+{
+  FILE *f;
+
+  init();
+  error_str[0] = '\0';
+  f = size ? fmemopen((void *) image, size, "rb") : NULL;
+  if (! f)
+    return I2L_BAD_ARGUMENT;
+  return load_stream(f);
+}
+
+
+int i2l_run(uint64_t count, uint64_t *executed)
+{
+  uint64_t start;
+  int i;
+
+  if (! loaded)
+    return I2L_NOT_LOADED;
+  if (! started)
+    {
+      insn_count = 0;
+      error_str[0] = '\0';
+    }
+  start = insn_count;
+  yield_count = (count > UINT64_MAX - insn_count) ? UINT64_MAX : insn_count + count;
+
+  error_longjmp = true;
+  if (started)
+    interp_resume();
+  else
+    interp();
+  error_longjmp = false;
+
+  for (i = 0; i < MAX_DEVICES; i++)
+    if (host_out[i])
+      fflush(host_out[i]);
+  fflush(con_out);
+  if (executed)
+    *executed = insn_count - start;
+
+  started = (yielded != YIELD_NONE);
+  if (started)
+    return I2L_OK;
+  return err ? err : I2L_EXITED;
+}
+
+
+int i2l_get_reg(i2l_reg_t reg, uint16_t *value)
+{
+  switch (reg)
+    {
+    case I2L_REG_PC:          *value = pc;         break;
+    case I2L_REG_SP:          *value = sp;         break;
+    case I2L_REG_HP:          *value = hp;         break;
+    case I2L_REG_LEVEL:       *value = level;      break;
+    case I2L_REG_HEAP_START:  *value = heap_start; break;
+    default:
+      if ((reg < I2L_REG_DISPLAY0) || (reg >= I2L_REG_DISPLAY0 + MAX_LEVEL))
+	return I2L_BAD_ARGUMENT;
+      *value = display[reg - I2L_REG_DISPLAY0];
+    }
+  return I2L_OK;
+}
+
+
+int i2l_set_reg(i2l_reg_t reg, uint16_t value)
+{
+  switch (reg)
+    {
+    case I2L_REG_PC:
+      pc = value;
+      break;
+    case I2L_REG_SP:
+      if ((value < STACK_MIN) || (value > INITIAL_STACK))
+	return I2L_BAD_ARGUMENT;
+      sp = value;
+      break;
+    case I2L_REG_HP:
+      if (value > heap_limit)
+	return I2L_BAD_ARGUMENT;
+      hp = value;
+      break;
+    case I2L_REG_LEVEL:
+      if (value >= MAX_LEVEL)
+	return I2L_BAD_ARGUMENT;
+      level = value;
+      break;
+    case I2L_REG_HEAP_START:
+      heap_start = value;
+      break;
+    default:
+      if ((reg < I2L_REG_DISPLAY0) || (reg >= I2L_REG_DISPLAY0 + MAX_LEVEL))
+	return I2L_BAD_ARGUMENT;
+      display[reg - I2L_REG_DISPLAY0] = value;
+    }
+  return I2L_OK;
+}
+
+
+uint64_t i2l_insn_count(void)
+{
+  return insn_count;
+}
+
+
+int i2l_read_mem(uint16_t addr, void *buf, size_t len)
+{
+  if (addr + len > MAX_MEM)
+    return I2L_BAD_ARGUMENT;
+  memcpy(buf, & mem[addr], len);
+  return I2L_OK;
+}
+
+
+int i2l_write_mem(uint16_t addr, const void *buf, size_t len)
+{
+  if (addr + len > MAX_MEM)
+    return I2L_BAD_ARGUMENT;
+  memcpy(& mem[addr], buf, len);
+  return I2L_OK;
+}
+
+
+static ssize_t device_read(void *cookie, char *buf, size_t size)
+{
+  device_t *d = cookie;
+  return d->read(d->ctx, d->dev, buf, size);
+}
+
+
+// A cookie write function returns 0 for an error.
+static ssize_t device_write(void *cookie, const char *buf, size_t size)
+{
+  device_t *d = cookie;
+  ssize_t r = d->write(d->ctx, d->dev, buf, size);
+  return (r < 0) ? 0 : r;
+}
+
+
+int i2l_set_device(int dev, i2l_read_fn *read, i2l_write_fn *write, void *ctx)
+{
+  device_t *d;
+
+  if ((dev < 0) || (dev >= MAX_DEVICES))
+    return I2L_BAD_ARGUMENT;
+  init();
+  d = & devices[dev];
+  if (host_in[dev])
+    fclose(host_in[dev]);
+  if (host_out[dev])
+    fclose(host_out[dev]);
+  host_in[dev] = NULL;
+  host_out[dev] = NULL;
+
+  d->dev = dev;
+  d->read = read;
+  d->write = write;
+  d->ctx = ctx;
+  if (read)
+    host_in[dev] = fopencookie(d, "r", (cookie_io_functions_t) { .read = device_read });
+  if (write)
+    host_out[dev] = fopencookie(d, "w", (cookie_io_functions_t) { .write = device_write });
+  if ((read && ! host_in[dev]) || (write && ! host_out[dev]))
+    return ERR_IO_ERROR;
+  return I2L_OK;
+}
+
+
+int i2l_set_heap_limit(uint16_t limit)
+{
+  init();
+  heap_limit = limit;
+  return I2L_OK;
+}
+
+
+int i2l_set_extended_memory(size_t kb)
+{
+  if (kb * 1024 > XMEM_MAX_PARAS * XMEM_PARAGRAPH)
+    return I2L_BAD_ARGUMENT;
+  init();
+  free(xmem);
+  xmem = NULL;
+  xmem_paras = kb * 1024 / XMEM_PARAGRAPH;
+  xmem_top = 0;
+  if (kb)
+    return catch_errors(xmem_start);
+  return I2L_OK;
+}
+
+
+int i2l_register_intrinsic(int num, const char *name, i2l_native_fn *fn, void *ctx)
+{
+  init();
+  return native_register_intrinsic(num, name, fn, ctx) ? I2L_BAD_ARGUMENT : I2L_OK;
+}
+
+
+int i2l_register_external(uint16_t num, const char *name, i2l_native_fn *fn, void *ctx)
+{
+  init();
+  return native_register_external(num, name, fn, ctx) ? I2L_BAD_ARGUMENT : I2L_OK;
+}
+
+
+static const char *plugin_fn;
+
+static void plugin(void)
+{
+  load_plugin(plugin_fn);
+}
+
+int i2l_load_plugin(const char *fn)
+{
+  init();
+  error_str[0] = '\0';
+  plugin_fn = fn;
+  return catch_errors(plugin);
+}
+
+
+const char *i2l_error(void)
+{
+  return error_str;
+}
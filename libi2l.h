@@ -0,0 +1,92 @@
+// libi2l - I2L interpreter library
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// Runs I2L programs inside another program.  The interpreter state is
+// global, so a process has one I2L program loaded at a time.  Errors
+// are returned, never reported by exiting.
+//
+// Typical use:
+//   i2l_load_file("demo/prime.i2l");
+//   i2l_set_device(0, my_read, my_write, my_ctx);
+//   while ((r = i2l_run(100000, NULL)) == I2L_OK)
+//     ;  // do other work between slices
+
+#ifndef LIBI2L_H
+#define LIBI2L_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "i2l_native.h"
+
+// Results.  Positive values are I2L error numbers, as returned by the
+// i2l command as its exit status; i2l_error() has the message.
+enum
+{
+  I2L_OK = 0,              // ran the instructions asked for
+  I2L_EXITED = -1,         // the program exited
+  I2L_BAD_ARGUMENT = -2,
+  I2L_NOT_LOADED = -3,
+};
+
+typedef enum
+{
+  I2L_REG_PC,
+  I2L_REG_SP,
+  I2L_REG_HP,
+  I2L_REG_LEVEL,
+  I2L_REG_HEAP_START,
+  I2L_REG_DISPLAY0,        // through I2L_REG_DISPLAY0 + 7
+} i2l_reg_t;
+
+// Device callbacks, called with the context given to i2l_set_device().
+// read returns the number of bytes stored in buf, 0 at end of file or
+// -1 on error; write returns the number of bytes written or -1.  The
+// data is what device 0 would see: lines end in a newline.
+typedef ssize_t i2l_read_fn(void *ctx, int dev, char *buf, size_t size);
+typedef ssize_t i2l_write_fn(void *ctx, int dev, const char *buf, size_t size);
+
+// Loads an image in I2L hex format, replacing any loaded program.
+int i2l_load_file(const char *fn);
+int i2l_load_mem(const void *image, size_t size);
+
+// Runs at most count instructions, starting the program if it hasn't
+// started or has exited, and stores the number run in *executed if
+// executed isn't NULL.  i2l_run(0, NULL) just sets up the registers.
+int i2l_run(uint64_t count, uint64_t *executed);
+
+// Registers and memory, which the host may change between runs.
+// Loading converts some code sequences to internal instructions, so
+// code bytes can differ from the image.
+int i2l_get_reg(i2l_reg_t reg, uint16_t *value);
+int i2l_set_reg(i2l_reg_t reg, uint16_t value);
+uint64_t i2l_insn_count(void);
+int i2l_read_mem(uint16_t addr, void *buf, size_t len);
+int i2l_write_mem(uint16_t addr, const void *buf, size_t len);
+
+// Attaches callbacks to a device from 0 to 7, in place of its built-in
+// handling; either may be NULL.  By default device 0 is stdin and
+// stdout, and only devices 0, 3 and 7 exist.
+int i2l_set_device(int dev, i2l_read_fn *read, i2l_write_fn *write, void *ctx);
+
+// Memory configuration, as with the i2l command's --heap-limit and
+// --extended-memory options, taking effect at the next load.  The heap
+// ends below limit, by default 0x5fff, and may use all of memory
+// above the program up to 0xffff.  Extended memory of up to 1024 KB
+// is reached through the intrinsics registered by xmem.c; there is
+// none by default.
+int i2l_set_heap_limit(uint16_t limit);
+int i2l_set_extended_memory(size_t kb);
+
+// Native functions for unimplemented CML intrinsic numbers and for ECL
+// external procedures, as in i2l_native.h, registered directly or by
+// a plugin's i2l_plugin_init().  They stay registered across loads.
+int i2l_register_intrinsic(int num, const char *name, i2l_native_fn *fn, void *ctx);
+int i2l_register_external(uint16_t num, const char *name, i2l_native_fn *fn, void *ctx);
+int i2l_load_plugin(const char *fn);
+
+// Message for the last error, or "" if there wasn't one.
+const char *i2l_error(void);
+
+#endif // LIBI2L_H
@@ -0,0 +1,250 @@
+// I2L interpreter - runtime metrics in Prometheus text format
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// The interpreter counts calls, intrinsic calls, device bytes, reruns
+// and errors when metrics is set, and keeps the heap high-water mark;
+// the stack high-water mark costs nothing at run time, since the stack
+// is filled with a pattern at the start and the deepest byte that no
+// longer holds it is found when the metrics are written.  The metrics
+// file is written at exit, on SIGUSR1, and every N seconds with
+// --metrics-every N, by a timer that raises SIGUSR1.  The file is
+// written from the signal handler, so only async-signal-safe calls
+// are used, and it is replaced by a rename, so that a collector such
+// as the node exporter's textfile collector never sees it partly
+// written.  Labelled counters are only written once they're nonzero.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "i2l.h"
+
+
+bool metrics;
+char *metrics_fn;
+unsigned int metrics_every;  // seconds, 0 for none
+
+uint64_t metrics_calls;
+uint64_t metrics_intrinsics[INTRINSIC_MAX];
+uint64_t metrics_read[MAX_DEVICES];
+uint64_t metrics_written[MAX_DEVICES];
+uint64_t metrics_reruns;
+uint64_t metrics_errors[METRICS_ERRORS];
+uint16_t metrics_heap_high;
+
+static const char *error_names[METRICS_ERRORS] =
+{
+  [ERR_DIVISION_BY_ZERO]        = "division_by_zero",
+  [ERR_HEAP_OVERFLOW]           = "heap_overflow",
+  [ERR_IO_ERROR]                = "io_error",
+  [ERR_BAD_OPCODE]              = "bad_opcode",
+  [ERR_BAD_INTRINSIC]           = "bad_intrinsic",
+  [ERR_LOADER_FAILURE]          = "loader_failure",
+  [ERR_BAD_CMD_LINE]            = "bad_cmd_line",
+  [ERR_ABORT]                   = "abort",
+  [ERR_UNIMPLEMENTED_OPCODE]    = "unimplemented_opcode",
+  [ERR_UNIMPLEMENTED_INTRINSIC] = "unimplemented_intrinsic",
+  [ERR_BAD_LEVEL]               = "bad_level",
+  [ERR_STACK_UNDERFLOW]         = "stack_underflow",
+  [ERR_STACK_OVERFLOW]          = "stack_overflow",
+  [ERR_HEAP_UNDERFLOW]          = "heap_underflow",
+  [ERR_INTERNAL_ERROR]          = "internal_error",
+  [ERR_INSTRUCTION_LIMIT]       = "instruction_limit",
+  [ERR_TIMEOUT]                 = "timeout",
+};
+
+static char *tmp_fn;
+static volatile sig_atomic_t writing;
+
+static char buf[32768];
+static size_t len;
+
+
+// snprintf isn't async-signal-safe, so the file is formatted by hand.
+static void put(const char *s)
+{
+  size_t n = strlen(s);
+  if (len + n > sizeof(buf))
+    n = sizeof(buf) - len;
+  memcpy(& buf[len], s, n);
+  len += n;
+}
+
+static void put_u64(uint64_t v)
+{
+  char digits[21];
+  int i = sizeof(digits) - 1;
+
+  digits[i] = '\0';
+  do
+    {
+      digits[--i] = '0' + v % 10;
+      v /= 10;
+    }
+  while (v);
+  put(& digits[i]);
+}
+
+static void header(const char *name, const char *type, const char *help)
+{
+  put("# HELP ");
+  put(name);
+  put(" ");
+  put(help);
+  put("\n# TYPE ");
+  put(name);
+  put(" ");
+  put(type);
+  put("\n");
+}
+
+static void value(const char *name, uint64_t v)
+{
+  put(name);
+  put(" ");
+  put_u64(v);
+  put("\n");
+}
+
+static void device_values(const char *name, uint64_t *counts)
+{
+  int i;
+
+  for (i = 0; i < MAX_DEVICES; i++)
+    if (counts[i])
+      {
+	put(name);
+	put("{device=\"");
+	put_u64(i);
+	put("\"} ");
+	put_u64(counts[i]);
+	put("\n");
+      }
+}
+
+
+void metrics_write(void)
+{
+  int fd;
+  int i;
+
+  if (! metrics || writing)
+    return;
+  writing = 1;
+  len = 0;
+
+  header("i2l_instructions_total", "counter", "I2L instructions executed.");
+  value("i2l_instructions_total", insn_count);
+  header("i2l_calls_total", "counter", "I2L procedure calls.");
+  value("i2l_calls_total", metrics_calls);
+
+  header("i2l_intrinsic_calls_total", "counter", "Intrinsic calls by name.");
+  for (i = 0; i < INTRINSIC_MAX; i++)
+    if (metrics_intrinsics[i])
+      {
+	const char *name = intrinsic[i].name ? intrinsic[i].name : native_intrinsic_name(i);
+	put("i2l_intrinsic_calls_total{intrinsic=\"");
+	if (name)
+	  put(name);
+	else
+	  put_u64(i);
+	put("\"} ");
+	put_u64(metrics_intrinsics[i]);
+	put("\n");
+      }
+
+  header("i2l_device_read_bytes_total", "counter", "Bytes read by device.");
+  device_values("i2l_device_read_bytes_total", metrics_read);
+  header("i2l_device_written_bytes_total", "counter", "Bytes written by device.");
+  device_values("i2l_device_written_bytes_total", metrics_written);
+
+  header("i2l_heap_high_water_bytes", "gauge", "Most heap used.");
+  value("i2l_heap_high_water_bytes", (metrics_heap_high > heap_start) ? metrics_heap_high - heap_start : 0);
+  header("i2l_heap_limit_bytes", "gauge", "Heap size, from the start of the heap to heap_limit.");
+  value("i2l_heap_limit_bytes", (heap_limit > heap_start) ? heap_limit - heap_start : 0);
+  header("i2l_stack_high_water_bytes", "gauge", "Most evaluation stack used.");
+  value("i2l_stack_high_water_bytes", stack_high_water());
+  header("i2l_stack_size_bytes", "gauge", "Evaluation stack size, down to STACK_MIN.");
+  value("i2l_stack_size_bytes", INITIAL_STACK - STACK_MIN + 1);
+
+  header("i2l_reruns_total", "counter", "Restarts of the program by RESTART.");
+  value("i2l_reruns_total", metrics_reruns);
+
+  header("i2l_errors_total", "counter", "Errors by I2L error number, trapped or not.");
+  for (i = 0; i < METRICS_ERRORS; i++)
+    if (metrics_errors[i])
+      {
+	put("i2l_errors_total{code=\"");
+	put_u64(i);
+	put("\",error=\"");
+	put(error_names[i] ? error_names[i] : "unknown");
+	put("\"} ");
+	put_u64(metrics_errors[i]);
+	put("\n");
+      }
+
+  fd = open(tmp_fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0)
+    {
+      bool ok = write(fd, buf, len) == (ssize_t) len;
+      close(fd);
+      if (ok)
+	rename(tmp_fn, metrics_fn);
+      else
+	unlink(tmp_fn);
+    }
+  writing = 0;
+}
+
+
+static void metrics_handler(int sig)
+{
+  (void) sig;
+  metrics_write();
+}
+
+
+void metrics_start(void)
+{
+  struct sigaction sa;
+
+  tmp_fn = malloc(strlen(metrics_fn) + 5);
+  if (! tmp_fn)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+  strcpy(tmp_fn, metrics_fn);
+  strcat(tmp_fn, ".tmp");
+
+  stack_paint();
+  metrics_heap_high = heap_start;
+  metrics = true;
+
+  memset(& sa, 0, sizeof(sa));
+  sa.sa_handler = metrics_handler;
+  sa.sa_flags = SA_RESTART;  // console reads carry on
+  sigaction(SIGUSR1, & sa, NULL);
+
+  if (metrics_every)
+    {
+      struct sigevent sev;
+      struct itimerspec its;
+      timer_t timer;
+
+      memset(& sev, 0, sizeof(sev));
+      sev.sigev_notify = SIGEV_SIGNAL;
+      sev.sigev_signo = SIGUSR1;
+      if (timer_create(CLOCK_MONOTONIC, & sev, & timer))
+	fatal_error(ERR_INTERNAL_ERROR, "can't create metrics timer");
+      memset(& its, 0, sizeof(its));
+      its.it_value.tv_sec = metrics_every;
+      its.it_interval.tv_sec = metrics_every;
+      timer_settime(timer, 0, & its, NULL);
+    }
+  atexit(metrics_write);
+}
@@ -0,0 +1,142 @@
+// I2L interpreter - native intrinsic and external procedure registry
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// CML of an intrinsic number without a built-in intrinsic, and ECL,
+// call native functions registered here; see i2l_native.h.  There are
+// few external procedures, so they are found by a linear search.
+
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+typedef struct
+{
+  const char *name;
+  i2l_native_fn *fn;
+  void *ctx;
+  uint16_t num;
+} native_t;
+
+#define MAX_EXTERNALS 256
+
+static native_t intrinsics[INTRINSIC_MAX];
+static native_t externals[MAX_EXTERNALS];
+static int external_count;
+
+
+static uint16_t api_read16(uint16_t addr)
+{
+  return read16(addr);
+}
+
+static void api_write16(uint16_t addr, uint16_t value)
+{
+  write16(addr, value);
+}
+
+static void api_error(int num, const char *msg)
+{
+  fatal_error(num, "%s", msg);
+}
+
+const i2l_native_api_t native_api =
+{
+  .version = I2L_NATIVE_VERSION,
+  .mem = mem,
+  .pop = stack_pop,
+  .push = stack_push,
+  .read16 = api_read16,
+  .write16 = api_write16,
+  .error = api_error,
+  .register_intrinsic = native_register_intrinsic,
+  .register_external = native_register_external,
+};
+
+
+// Only intrinsic numbers the interpreter doesn't implement can be used.
+int native_register_intrinsic(int num, const char *name, i2l_native_fn *fn, void *ctx)
+{
+  native_t *n;
+
+  if ((num < 0) || (num >= INTRINSIC_MAX) || intrinsic[num].fn || ! fn)
+    return -1;
+  n = & intrinsics[num];
+  if (n->fn)
+    return -1;
+  n->name = name;
+  n->fn = fn;
+  n->ctx = ctx;
+  n->num = num;
+  return 0;
+}
+
+
+int native_register_external(uint16_t num, const char *name, i2l_native_fn *fn, void *ctx)
+{
+  native_t *n;
+  int i;
+
+  if ((external_count == MAX_EXTERNALS) || ! fn)
+    return -1;
+  for (i = 0; i < external_count; i++)
+    if (externals[i].num == num)
+      return -1;
+  n = & externals[external_count++];
+  n->name = name;
+  n->fn = fn;
+  n->ctx = ctx;
+  n->num = num;
+  return 0;
+}
+
+
+const char *native_intrinsic_name(int num)
+{
+  native_t *n = & intrinsics[num];
+  return n->fn ? n->name : "unknown";
+}
+
+
+void native_intrinsic(int num)
+{
+  native_t *n = & intrinsics[num];
+  if (! n->fn)
+    fatal_error(ERR_BAD_INTRINSIC, NULL);
+  n->fn(& native_api, n->ctx);
+}
+
+
+void native_external(uint16_t num)
+{
+  int i;
+  for (i = 0; i < external_count; i++)
+    if (externals[i].num == num)
+      {
+	externals[i].fn(& native_api, externals[i].ctx);
+	return;
+      }
+  fatal_error(ERR_UNIMPLEMENTED_OPCODE, "no external procedure %" PRIu16, num);
+}
+
+
+void load_plugin(const char *fn)
+{
+  void *handle;
+  int (*init)(const i2l_native_api_t *api);
+
+  handle = dlopen(fn, RTLD_NOW | RTLD_LOCAL);
+  if (! handle)
+    fatal_error(ERR_BAD_CMD_LINE, "can't load plugin %s", dlerror());
+  init = (int (*)(const i2l_native_api_t *)) dlsym(handle, "i2l_plugin_init");
+  if (! init)
+    fatal_error(ERR_BAD_CMD_LINE, "no i2l_plugin_init in %s", fn);
+  if (init(& native_api))
+    fatal_error(ERR_BAD_CMD_LINE, "plugin %s failed to initialize", fn);
+}
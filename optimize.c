@@ -0,0 +1,528 @@
+// I2L interpreter - peephole optimizer
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// The loaded image is split into the reachable instructions found by
+// the control flow analysis and data bytes.  Short instruction
+// sequences are rewritten or deleted, jumps to jumps are threaded,
+// and the result is laid out again and written as a new I2L file.
+//
+// Every address held in a relocated word (branch operands, procedure
+// addresses, fixups) is "pinned": execution may start there, so a
+// rewrite never spans a pinned instruction other than its first.
+// The heap still starts at the original address, so programs that
+// use absolute heap addresses are unaffected.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+typedef struct
+{
+  uint16_t addr;     // original address
+  uint16_t new_addr;
+  uint8_t len;
+  uint8_t bytes[16];
+  int8_t reloc_at;   // offset of a relocated word within bytes, or -1
+  bool insn;
+  bool deleted;
+} item_t;
+
+static item_t *items;
+static int item_count;
+static int *item_at;       // item index by original address, or -1
+static uint8_t *pinned;
+static uint16_t image_end;  // new address following the last item
+
+enum
+{
+  RW_ZERO_OP,     // add/subtract/or zero, multiply by one
+  RW_FOLD,        // operator applied to constants
+  RW_DROP,        // value pushed and dropped
+  RW_INC,         // variable incremented by one
+  RW_TEST_ZERO,   // comparison with zero before a conditional jump
+  RW_THREAD,      // branch to a jump
+  RW_JMP_RET,     // jump to a return
+  RW_JMP_NEXT,    // jump to the next instruction
+  RW_COUNT
+};
+
+static const char *rewrite_names[RW_COUNT] =
+  {
+    [RW_ZERO_OP]  = "identity operations removed",
+    [RW_FOLD]     = "constant expressions folded",
+    [RW_DROP]     = "pushes of dropped values removed",
+    [RW_INC]      = "increments of variables combined",
+    [RW_TEST_ZERO] = "comparisons with zero removed",
+    [RW_THREAD]   = "branches to jumps threaded",
+    [RW_JMP_RET]  = "jumps to returns replaced",
+    [RW_JMP_NEXT] = "jumps to the next instruction removed",
+  };
+
+static int rewrites[RW_COUNT];
+
+
+static void add_item(uint16_t addr, int len, bool insn)
+{
+  item_t *it = & items[item_count];
+
+  it->addr = addr;
+  it->len = len;
+  memcpy(it->bytes, & mem[addr], len);
+  it->reloc_at = -1;
+  for (int i = 0; i < len; i++)
+    if (reloc[(uint16_t) (addr + i)])
+      {
+	if ((i == len - 1) || (insn && ((i != len - 2) || (len < 3))))
+	  fatal_error(ERR_INTERNAL_ERROR, "can't optimize, relocated word at %04" PRIx16 " overlaps an opcode", (uint16_t) (addr + i));
+	it->reloc_at = i;
+      }
+  it->insn = insn;
+  it->deleted = false;
+  item_at[addr] = item_count++;
+}
+
+
+static void split_image(void)
+{
+  uint32_t addr = CODE_START;
+
+  items = calloc(heap_start - CODE_START, sizeof(item_t));
+  item_at = malloc(MAX_MEM * sizeof(int));
+  pinned = calloc(MAX_MEM, 1);
+  if (! items || ! item_at || ! pinned)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+  for (int i = 0; i < MAX_MEM; i++)
+    item_at[i] = -1;
+
+  while (addr < heap_start)
+    {
+      if (code_flags[addr] & CF_INSN)
+	{
+	  int len = insn_length(addr);
+	  for (int i = 1; i < len; i++)
+	    if (code_flags[addr + i] & CF_INSN)
+	      fatal_error(ERR_INTERNAL_ERROR, "can't optimize, overlapping instructions at %04" PRIx32, addr);
+	  add_item(addr, len, true);
+	  addr += len;
+	}
+      else if (reloc[addr] && (addr + 1 < heap_start) && ! (code_flags[addr + 1] & CF_INSN))
+	{
+	  add_item(addr, 2, false);
+	  addr += 2;
+	}
+      else
+	add_item(addr++, 1, false);
+    }
+
+  // Every relocated word is a potential entry point.  Branch operands
+  // that weren't relocated can't be moved safely.
+  pinned[CODE_START] = true;
+  for (int i = 0; i < item_count; i++)
+    {
+      item_t *it = & items[i];
+      uint16_t target;
+
+      if (it->reloc_at >= 0)
+	pinned[read16(it->addr + it->reloc_at)] = true;
+      if (it->insn && insn_target(it->addr, & target) && (it->reloc_at < 0))
+	fatal_error(ERR_INTERNAL_ERROR, "can't optimize, branch at %04" PRIx16 " isn't relocatable", it->addr);
+    }
+}
+
+
+// Index of the first live item at or after index i, or item_count.
+static int next_live(int i)
+{
+  while ((i < item_count) && items[i].deleted)
+    i++;
+  return i;
+}
+
+
+// Live instruction following item i, if it can be merged with it.
+static int next_mergeable(int i)
+{
+  int j = next_live(i + 1);
+  if ((j == item_count) || ! items[j].insn || pinned[items[j].addr])
+    return -1;
+  return j;
+}
+
+
+static uint8_t opcode(int i)
+{
+  return items[i].bytes[0];
+}
+
+
+static uint16_t operand16(item_t *it)
+{
+  return it->bytes[1] | (it->bytes[2] << 8);
+}
+
+
+static bool constant(int i, uint16_t *value)
+{
+  item_t *it = & items[i];
+
+  if (it->reloc_at >= 0)
+    return false;
+  switch (opcode(i))
+    {
+    case 0x0b:  // IMM
+      *value = operand16(it);
+      return true;
+    case 0x24:  // IMS
+      *value = (int8_t) it->bytes[1];
+      return true;
+    }
+  return false;
+}
+
+
+static void set_constant(int i, uint16_t value)
+{
+  item_t *it = & items[i];
+
+  if ((int16_t) value >= -128 && (int16_t) value <= 127)
+    {
+      it->bytes[0] = 0x24;  // IMS
+      it->bytes[1] = value;
+      it->len = 2;
+    }
+  else
+    {
+      it->bytes[0] = 0x0b;  // IMM
+      it->bytes[1] = value;
+      it->bytes[2] = value >> 8;
+      it->len = 3;
+    }
+}
+
+
+// Instructions that only push a value, with no other effect.
+static bool pure_push(int i)
+{
+  uint16_t value;
+
+  if (constant(i, & value))
+    return true;
+  switch (opcode(i))
+    {
+    case 0x01:  // LOD
+    case 0x1d:  // DUPCAT
+    case 0x21:  // ADR
+      return true;
+    }
+  return opcode(i) >= 0x80;  // short global load
+}
+
+
+// Variable loaded by a LOD or short global load, as the level and
+// offset operand bytes of LOD, STO and INC.
+static bool load_var(int i, uint8_t *level, uint8_t *offset)
+{
+  item_t *it = & items[i];
+
+  if (opcode(i) == 0x01)  // LOD
+    {
+      *level = it->bytes[1];
+      *offset = it->bytes[2];
+      return true;
+    }
+  if (opcode(i) >= 0x80)
+    {
+      *level = 0;
+      *offset = (opcode(i) & 0x7f) << 1;
+      return true;
+    }
+  return false;
+}
+
+
+static bool fold(uint8_t op, uint16_t a, uint16_t b, uint16_t *result)
+{
+  switch (op)
+    {
+    case 0x0d: *result = a + b; return true;                         // ADD
+    case 0x0e: *result = a - b; return true;                         // SUB
+    case 0x0f: *result = (int16_t) a * (int16_t) b; return true;     // MUY
+    case 0x1a: *result = a | b; return true;                         // OR
+    case 0x1b: *result = a & b; return true;                         // AND
+    }
+  return false;
+}
+
+
+static bool rewrite_at(int i)
+{
+  uint16_t a, b, result;
+  uint8_t level, offset;
+  int j, k, l;
+
+  if (! items[i].insn)
+    return false;
+  j = next_mergeable(i);
+
+  if (constant(i, & a) && (j >= 0))
+    {
+      uint8_t op = opcode(j);
+      if (((a == 0) && ((op == 0x0d) || (op == 0x0e) || (op == 0x1a))) ||
+	  ((a == 1) && (op == 0x0f)))
+	{
+	  items[i].deleted = items[j].deleted = true;
+	  rewrites[RW_ZERO_OP]++;
+	  return true;
+	}
+      if ((op == 0x11) || (op == 0x1c))  // NEG, NOT
+	{
+	  set_constant(i, (op == 0x11) ? -a : ~a);
+	  items[j].deleted = true;
+	  rewrites[RW_FOLD]++;
+	  return true;
+	}
+      if (constant(j, & b) && ((k = next_mergeable(j)) >= 0) &&
+	  fold(opcode(k), a, b, & result))
+	{
+	  set_constant(i, result);
+	  items[j].deleted = items[k].deleted = true;
+	  rewrites[RW_FOLD]++;
+	  return true;
+	}
+    }
+
+  // x := x + 1  ->  INC x; DRP
+  if (load_var(i, & level, & offset) && (j >= 0) &&
+      constant(j, & a) && (a == 1) &&
+      ((k = next_mergeable(j)) >= 0) && (opcode(k) == 0x0d) &&  // ADD
+      ((l = next_mergeable(k)) >= 0) && (opcode(l) == 0x03) &&  // STO
+      (items[l].bytes[1] == level) && (items[l].bytes[2] == offset))
+    {
+      items[i].bytes[0] = 0x19;  // INC
+      items[i].bytes[1] = level;
+      items[i].bytes[2] = offset;
+      items[i].len = 3;
+      items[j].bytes[0] = 0x28;  // DRP
+      items[j].len = 1;
+      items[k].deleted = items[l].deleted = true;
+      rewrites[RW_INC]++;
+      return true;
+    }
+
+  // JPC jumps on zero, so there's no need for a NE with zero first
+  if (constant(i, & a) && (a == 0) && (j >= 0) && (opcode(j) == 0x13) &&  // NE
+      ((k = next_mergeable(j)) >= 0) && (opcode(k) == 0x08))               // JPC
+    {
+      items[i].deleted = items[j].deleted = true;
+      rewrites[RW_TEST_ZERO]++;
+      return true;
+    }
+
+  if (pure_push(i) && (j >= 0) && (opcode(j) == 0x28))  // DRP
+    {
+      items[i].deleted = items[j].deleted = true;
+      rewrites[RW_DROP]++;
+      return true;
+    }
+
+  return false;
+}
+
+
+// Item index that execution continues with at a branch target.
+static int destination(uint16_t target)
+{
+  if (item_at[target] < 0)
+    return item_count;
+  return next_live(item_at[target]);
+}
+
+
+// Follows a chain of unconditional jumps, returning the item index
+// of the final destination.
+static int resolve(uint16_t target)
+{
+  int i = destination(target);
+  int limit = 64;
+
+  while ((i < item_count) && items[i].insn && (opcode(i) == 0x07) && limit--)
+    {
+      int t = destination(operand16(& items[i]));
+      if ((t == i) || (t == item_count))
+	break;
+      i = t;
+    }
+  return i;
+}
+
+
+static bool rewrite_branch(int i)
+{
+  item_t *it = & items[i];
+  uint16_t target;
+  int t;
+
+  if (! it->insn)
+    return false;
+  switch (opcode(i))
+    {
+    case 0x07:  // JMP
+    case 0x08:  // JPC
+    case 0x18:  // FOR
+    case 0x25:  // CJP
+      break;
+    default:
+      return false;
+    }
+
+  target = operand16(it);
+  t = resolve(target);
+  if (t == item_count)
+    return false;
+
+  if ((opcode(i) == 0x07) && (t == next_live(i + 1)))
+    {
+      it->deleted = true;
+      rewrites[RW_JMP_NEXT]++;
+      return true;
+    }
+  if ((opcode(i) == 0x07) && items[t].insn &&
+      ((opcode(t) == 0x00) || (opcode(t) == 0x06) || (opcode(t) == 0x27)))
+    {
+      it->bytes[0] = opcode(t);
+      it->len = 1;
+      it->reloc_at = -1;
+      rewrites[RW_JMP_RET]++;
+      return true;
+    }
+  if (t != destination(target))
+    {
+      it->bytes[1] = items[t].addr;
+      it->bytes[2] = items[t].addr >> 8;
+      pinned[items[t].addr] = true;
+      rewrites[RW_THREAD]++;
+      return true;
+    }
+  return false;
+}
+
+
+static void layout(void)
+{
+  uint16_t addr = CODE_START;
+
+  for (int i = 0; i < item_count; i++)
+    {
+      items[i].new_addr = addr;
+      if (! items[i].deleted)
+	addr += items[i].len;
+    }
+  image_end = addr;
+}
+
+
+// New address of an original address, which is that of the next
+// surviving item if it was deleted.
+static uint16_t new_address(uint16_t addr)
+{
+  int i;
+
+  if ((addr < CODE_START) || (addr >= heap_start) || (item_at[addr] < 0))
+    return addr;
+  i = next_live(item_at[addr]);
+  return (i == item_count) ? image_end : items[i].new_addr;
+}
+
+
+static void write_image(FILE *f)
+{
+  int column = 0;
+
+  fprintf(f, ";0000");
+  for (int i = 0; i < item_count; i++)
+    {
+      item_t *it = & items[i];
+      if (it->deleted)
+	continue;
+      for (int j = 0; j < it->len; j++)
+	{
+	  if (column >= 32)
+	    {
+	      fprintf(f, "\r\n");
+	      column = 0;
+	    }
+	  if (j == it->reloc_at)
+	    {
+	      uint16_t value = new_address(it->bytes[j] | it->bytes[j + 1] << 8);
+	      fprintf(f, "*%04" PRIX16, (uint16_t) (value - CODE_START));
+	      j++;
+	      column += 2;
+	    }
+	  else
+	    fprintf(f, "%02" PRIX8, it->bytes[j]);
+	  column++;
+	}
+    }
+
+  // keep the heap where it was
+  if (image_end < heap_start)
+    fprintf(f, "\r\n;%04" PRIX16 "00", (uint16_t) (heap_start - 1 - CODE_START));
+  fprintf(f, "\r\n$");
+  write_symbols(f, new_address);
+}
+
+
+void optimize(char *out_fn)
+{
+  int before_insns = 0, before_bytes = 0;
+  int after_insns = 0, after_bytes = 0;
+  bool changed;
+  FILE *f;
+
+  analyze_code();
+  split_image();
+
+  for (int i = 0; i < item_count; i++)
+    if (items[i].insn)
+      {
+	before_insns++;
+	before_bytes += items[i].len;
+      }
+
+  do
+    {
+      changed = false;
+      for (int i = 0; i < item_count; i++)
+	if (! items[i].deleted &&
+	    (rewrite_at(i) || rewrite_branch(i)))
+	  changed = true;
+    }
+  while (changed);
+
+  for (int i = 0; i < item_count; i++)
+    if (items[i].insn && ! items[i].deleted)
+      {
+	after_insns++;
+	after_bytes += items[i].len;
+      }
+
+  layout();
+
+  f = fopen(out_fn, "w");
+  if (! f)
+    fatal_error(ERR_IO_ERROR, "can't open output file %s", out_fn);
+  write_image(f);
+  if (fclose(f))
+    fatal_error(ERR_IO_ERROR, "can't write output file %s", out_fn);
+
+  for (int i = 0; i < RW_COUNT; i++)
+    printf("%6d %s\n", rewrites[i], rewrite_names[i]);
+  printf("instructions: %d -> %d (%d removed)\n", before_insns, after_insns, before_insns - after_insns);
+  printf("code bytes:   %d -> %d (%d removed)\n", before_bytes, after_bytes, before_bytes - after_bytes);
+}
@@ -0,0 +1,342 @@
+// I2L interpreter - hardware performance counters per opcode
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// Counts user space cycles, instructions, branches, branch misses and
+// cache misses with perf_event_open(), which perf_event_paranoid 2
+// allows since the kernel is excluded.  Every Nth dispatch in
+// interp_run() reads the counters before and after the opcode handler
+// and adds the difference to that opcode, less the cost of the
+// reading itself, which is measured by an empty reading just
+// before.  On x86 the counters are read in user space with rdpmc
+// when the kernel permits it, so every dispatch can be measured;
+// otherwise each reading is a read() system call, and the default
+// is to measure one dispatch in 64 on average, at random intervals
+// so as not to alias with the program's loops.  Without a hardware
+// PMU, as in many virtual machines, the software task clock is
+// counted instead.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "i2l.h"
+
+
+bool perfctr;
+char *perfctr_fn;
+uint64_t perfctr_every;  // 0 for the default
+
+typedef struct
+{
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} counter_def_t;
+
+static const counter_def_t counter_defs[] =
+{
+  { "cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "branches",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+  { "br-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+
+#define MAX_COUNTERS (sizeof(counter_defs) / sizeof(counter_defs[0]))
+
+static const counter_def_t task_clock = { "task-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK };
+
+typedef struct
+{
+  const counter_def_t *def;
+  int fd;
+  struct perf_event_mmap_page *page;  // for rdpmc, or NULL
+} counter_t;
+
+static counter_t counters[MAX_COUNTERS];
+static int counter_count;
+static int group_fd = -1;
+static bool use_rdpmc;
+
+#define OPCODES 0x81  // 0x80 is the short global load
+
+typedef struct
+{
+  uint64_t executed;
+  uint64_t measured;
+  uint64_t sum[MAX_COUNTERS];
+} opcode_counts_t;
+
+static opcode_counts_t counts[OPCODES];
+static uint64_t overhead_sum[MAX_COUNTERS];
+static uint64_t overhead[MAX_COUNTERS];   // mean, per reading
+static uint64_t overhead_count;
+static uint64_t start_values[MAX_COUNTERS];
+static uint64_t countdown;
+static bool measuring;
+static uint32_t random_state = 1;
+
+
+static int perf_open(const counter_def_t *def, int group)
+{
+  struct perf_event_attr attr;
+
+  memset(& attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = def->type;
+  attr.config = def->config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(SYS_perf_event_open, & attr, 0, -1, group, 0);
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t rdpmc(uint32_t counter)
+{
+  uint32_t lo, hi;
+  __asm__ volatile ("rdpmc" : "=a" (lo), "=d" (hi) : "c" (counter));
+  return ((uint64_t) hi << 32) | lo;
+}
+
+// the self-monitoring protocol of linux/perf_event.h
+static inline uint64_t read_rdpmc(struct perf_event_mmap_page *page)
+{
+  uint32_t seq, idx;
+  uint64_t count;
+
+  do
+    {
+      seq = page->lock;
+      __asm__ volatile ("" ::: "memory");
+      idx = page->index;
+      count = page->offset;
+      if (idx)
+	{
+	  uint64_t pmc = rdpmc(idx - 1);
+	  pmc <<= 64 - page->pmc_width;
+	  count += (int64_t) pmc >> (64 - page->pmc_width);
+	}
+      __asm__ volatile ("" ::: "memory");
+    }
+  while (page->lock != seq);
+  return count;
+}
+#endif
+
+
+static inline void read_counters(uint64_t *values)
+{
+  uint64_t buf[1 + MAX_COUNTERS];
+  int i;
+
+#if defined(__x86_64__) || defined(__i386__)
+  if (use_rdpmc)
+    {
+      for (i = 0; i < counter_count; i++)
+	values[i] = read_rdpmc(counters[i].page);
+      return;
+    }
+#endif
+  if (read(group_fd, buf, sizeof(buf)) < (ssize_t) ((1 + counter_count) * sizeof(uint64_t)))
+    fatal_error(ERR_IO_ERROR, "can't read performance counters");
+  for (i = 0; i < counter_count; i++)
+    values[i] = buf[1 + i];
+}
+
+
+// 1 to 2 * perfctr_every - 1, so perfctr_every on average
+static uint64_t interval(void)
+{
+  if (perfctr_every == 1)
+    return 1;
+  random_state ^= random_state << 13;  // xorshift32
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return 1 + random_state % (2 * perfctr_every - 1);
+}
+
+
+void perfctr_begin(void)
+{
+  uint64_t empty[MAX_COUNTERS];
+  int i;
+
+  if (--countdown)
+    return;
+  countdown = interval();
+  measuring = true;
+  read_counters(empty);
+  read_counters(start_values);
+  for (i = 0; i < counter_count; i++)
+    overhead_sum[i] += start_values[i] - empty[i];
+  overhead_count++;
+}
+
+
+void perfctr_end(uint8_t opcode)
+{
+  opcode_counts_t *c = & counts[(opcode >= 0x80) ? 0x80 : opcode];
+  uint64_t values[MAX_COUNTERS];
+  int i;
+
+  c->executed++;
+  if (! measuring)
+    return;
+  read_counters(values);
+  measuring = false;
+  c->measured++;
+  for (i = 0; i < counter_count; i++)
+    c->sum[i] += values[i] - start_values[i];
+}
+
+
+static int column(const char *name)
+{
+  int i;
+  for (i = 0; i < counter_count; i++)
+    if (strcmp(counters[i].def->name, name) == 0)
+      return i;
+  return -1;
+}
+
+
+static const opcode_counts_t *sort_counts;
+
+static int compare_opcodes(const void *a, const void *b)
+{
+  const opcode_counts_t *ca = & sort_counts[*(const int *) a];
+  const opcode_counts_t *cb = & sort_counts[*(const int *) b];
+  double ea = ca->measured ? (double) ca->sum[0] * ca->executed / ca->measured : 0;
+  double eb = cb->measured ? (double) cb->sum[0] * cb->executed / cb->measured : 0;
+  return (ea < eb) - (ea > eb);
+}
+
+
+void perfctr_write(void)
+{
+  int order[OPCODES];
+  int n = 0;
+  int cycles = column("cycles");
+  int insns = column("instructions");
+  int branches = column("branches");
+  int misses = column("br-misses");
+  FILE *f;
+  int i, j;
+
+  if (! perfctr)
+    return;
+  perfctr = false;
+
+  f = fopen(perfctr_fn, "w");
+  if (! f)
+    {
+      fprintf(stderr, "%s: can't open performance counter file %s\n", progname, perfctr_fn);
+      return;
+    }
+
+  // measured values less the measurement overhead
+  for (j = 0; j < counter_count; j++)
+    overhead[j] = overhead_count ? overhead_sum[j] / overhead_count : 0;
+  for (i = 0; i < OPCODES; i++)
+    {
+      opcode_counts_t *c = & counts[i];
+      for (j = 0; j < counter_count; j++)
+	c->sum[j] = (c->sum[j] > c->measured * overhead[j]) ? c->sum[j] - c->measured * overhead[j] : 0;
+      if (c->executed)
+	order[n++] = i;
+    }
+  sort_counts = counts;
+  qsort(order, n, sizeof(int), compare_opcodes);
+
+  fprintf(f, "# %" PRIu64 " instructions, one dispatch in %" PRIu64 " measured with %s\n",
+	  insn_count, perfctr_every, use_rdpmc ? "rdpmc" : "read()");
+  fprintf(f, "# counts are per dispatch, less a measurement overhead of");
+  for (j = 0; j < counter_count; j++)
+    fprintf(f, " %" PRIu64 " %s", overhead[j], counters[j].def->name);
+  fprintf(f, "\n");
+  fprintf(f, "opcode    executed     measured");
+  for (j = 0; j < counter_count; j++)
+    fprintf(f, " %12s", counters[j].def->name);
+  if ((cycles >= 0) && (insns >= 0))
+    fprintf(f, "    ipc");
+  if ((branches >= 0) && (misses >= 0))
+    fprintf(f, "  miss%%");
+  fprintf(f, "\n");
+
+  for (i = 0; i < n; i++)
+    {
+      opcode_counts_t *c = & counts[order[i]];
+      const char *name = (order[i] == 0x80) ? "lods" : op[order[i]].name;
+      uint64_t m = c->measured ? c->measured : 1;
+
+      fprintf(f, "%-6s %11" PRIu64 " %12" PRIu64, name ? name : "???", c->executed, c->measured);
+      for (j = 0; j < counter_count; j++)
+	fprintf(f, " %12.1f", (double) c->sum[j] / m);
+      if ((cycles >= 0) && (insns >= 0))
+	fprintf(f, " %6.2f", c->sum[cycles] ? (double) c->sum[insns] / c->sum[cycles] : 0.0);
+      if ((branches >= 0) && (misses >= 0))
+	fprintf(f, " %6.2f", c->sum[branches] ? 100.0 * c->sum[misses] / c->sum[branches] : 0.0);
+      fprintf(f, "\n");
+    }
+  fclose(f);
+}
+
+
+void perfctr_start(void)
+{
+  unsigned int i;
+  int fd;
+
+  for (i = 0; i < MAX_COUNTERS; i++)
+    {
+      fd = perf_open(& counter_defs[i], group_fd);
+      if (fd < 0)
+	continue;
+      if (group_fd < 0)
+	group_fd = fd;
+      counters[counter_count].def = & counter_defs[i];
+      counters[counter_count].fd = fd;
+      counter_count++;
+    }
+  if (! counter_count)
+    {
+      group_fd = perf_open(& task_clock, -1);
+      if (group_fd < 0)
+	fatal_error(ERR_BAD_CMD_LINE, "can't open performance counters: %s", strerror(errno));
+      counters[0].def = & task_clock;
+      counters[0].fd = group_fd;
+      counter_count = 1;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+  // rdpmc only works for hardware counters the kernel lets us read
+  use_rdpmc = counters[0].def->type == PERF_TYPE_HARDWARE;
+  for (i = 0; use_rdpmc && (i < (unsigned) counter_count); i++)
+    {
+      void *p = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, counters[i].fd, 0);
+      if (p == MAP_FAILED)
+	use_rdpmc = false;
+      else
+	{
+	  counters[i].page = p;
+	  if (! counters[i].page->cap_user_rdpmc || ! counters[i].page->index)
+	    use_rdpmc = false;
+	}
+    }
+#endif
+  if (! perfctr_every)
+    perfctr_every = use_rdpmc ? 1 : 64;
+  countdown = interval();
+  perfctr = true;
+  atexit(perfctr_write);
+}
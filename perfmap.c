@@ -0,0 +1,251 @@
+// I2L interpreter - perf map and jitdump for I2L procedures
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// Linux perf only sees the interpreter's own functions.  With
+// --perf-map or --jitdump each procedure found by analyze_code() gets
+// a small native trampoline, and each CAL runs the procedure in a
+// nested interp_run() called through the procedure's trampoline, so
+// that the host call stack mirrors the I2L one.  The trampolines are
+// described to perf by /tmp/perf-<pid>.map, which "perf report" reads
+// directly, and by a jitdump file /tmp/jit-<pid>.dump for "perf
+// inject --jit", which needs "perf record -k mono".  The procedures
+// then appear as callers in "perf record -g" call chains, which follow
+// the trampolines' frame pointers.
+//
+// The nested interp_run() of a procedure returns when its RET runs;
+// errors and RESTART longjmp past the nesting.  A scheduler switching
+// VMs would need interp_run() to return, so --daemon can't be used.
+
+#include <elf.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "i2l.h"
+
+
+bool perfmap;
+bool perfmap_file;
+bool perfmap_jitdump;
+int perfmap_depth;  // of nested interp_run() calls
+bool perfmap_returned;
+
+typedef void trampoline_fn(void);
+
+#define TRAMPOLINE_SIZE 32
+
+static trampoline_fn **trampolines;  // indexed by procedure address
+static trampoline_fn *unknown;       // for CAL targets analysis missed
+static uint8_t *code;
+static size_t code_size;
+
+
+// Runs the procedure just called, until its RET.
+static void perfmap_run(void)
+{
+  perfmap_depth++;
+  interp_run();
+  perfmap_depth--;
+  if (perfmap_returned)
+    {
+      perfmap_returned = false;
+      run = true;
+    }
+}
+
+
+// Called by op_cal() once the frame is built.
+void perfmap_call(uint16_t target)
+{
+  trampoline_fn *t = trampolines[target];
+  (t ? t : unknown)();
+}
+
+
+// Runs the main program through its trampoline, then the exit opcode
+// it returns to.
+void perfmap_main(void)
+{
+  perfmap_depth = 0;
+  perfmap_returned = false;
+  trampolines[CODE_START]();
+  if (run)
+    interp_run();
+}
+
+
+#if defined(__x86_64__)
+#define ELF_MACH EM_X86_64
+
+// push rbp; mov rbp,rsp; movabs rax,fn; call rax; pop rbp; ret
+static void emit_trampoline(uint8_t *p, void (*fn)(void))
+{
+  static const uint8_t prologue[] = { 0x55, 0x48, 0x89, 0xe5, 0x48, 0xb8 };
+  static const uint8_t epilogue[] = { 0xff, 0xd0, 0x5d, 0xc3 };
+  uint64_t addr = (uintptr_t) fn;
+
+  memset(p, 0xcc, TRAMPOLINE_SIZE);  // int3
+  memcpy(p, prologue, sizeof(prologue));
+  memcpy(p + sizeof(prologue), & addr, sizeof(addr));
+  memcpy(p + sizeof(prologue) + sizeof(addr), epilogue, sizeof(epilogue));
+}
+#endif
+
+
+static void write_perf_map(uint16_t *procs, int count)
+{
+  char fn[64];
+  char name[64];
+  FILE *f;
+  int i;
+
+  snprintf(fn, sizeof(fn), "/tmp/perf-%d.map", (int) getpid());
+  f = fopen(fn, "w");
+  if (! f)
+    fatal_error(ERR_IO_ERROR, "can't create %s", fn);
+  for (i = 0; i < count; i++)
+    fprintf(f, "%" PRIxPTR " %x I2L:%s\n",
+	    (uintptr_t) (code + i * TRAMPOLINE_SIZE), TRAMPOLINE_SIZE,
+	    proc_name(procs[i], name, sizeof(name)));
+  fprintf(f, "%" PRIxPTR " %x I2L:unknown\n",
+	  (uintptr_t) (code + count * TRAMPOLINE_SIZE), TRAMPOLINE_SIZE);
+  fclose(f);
+}
+
+
+// The jitdump format is described in the Linux source,
+// tools/perf/Documentation/jitdump-specification.txt.
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+} jitdump_header_t;
+
+typedef struct
+{
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+} jitdump_code_load_t;
+
+#define JITDUMP_MAGIC 0x4a695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+static uint64_t timestamp(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, & ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void write_code_load(FILE *f, const char *name, uint8_t *addr, uint64_t index)
+{
+  jitdump_code_load_t r;
+
+  r.id = JIT_CODE_LOAD;
+  r.total_size = sizeof(r) + strlen(name) + 1 + TRAMPOLINE_SIZE;
+  r.timestamp = timestamp();
+  r.pid = getpid();
+  r.tid = syscall(SYS_gettid);
+  r.vma = (uintptr_t) addr;
+  r.code_addr = (uintptr_t) addr;
+  r.code_size = TRAMPOLINE_SIZE;
+  r.code_index = index;
+  fwrite(& r, sizeof(r), 1, f);
+  fwrite(name, strlen(name) + 1, 1, f);
+  fwrite(addr, TRAMPOLINE_SIZE, 1, f);
+}
+
+static void write_jitdump(uint16_t *procs, int count)
+{
+  char fn[64];
+  char name[64];
+  char sym[70];
+  jitdump_header_t h;
+  FILE *f;
+  int i;
+
+  snprintf(fn, sizeof(fn), "/tmp/jit-%d.dump", (int) getpid());
+  f = fopen(fn, "w+");
+  if (! f)
+    fatal_error(ERR_IO_ERROR, "can't create %s", fn);
+
+  // perf record notices the dump file by this executable mapping
+  if (mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(f), 0) == MAP_FAILED)
+    fatal_error(ERR_IO_ERROR, "can't map %s", fn);
+
+  memset(& h, 0, sizeof(h));
+  h.magic = JITDUMP_MAGIC;
+  h.version = JITDUMP_VERSION;
+  h.total_size = sizeof(h);
+  h.elf_mach = ELF_MACH;
+  h.pid = getpid();
+  h.timestamp = timestamp();
+  fwrite(& h, sizeof(h), 1, f);
+  for (i = 0; i < count; i++)
+    {
+      snprintf(sym, sizeof(sym), "I2L:%s", proc_name(procs[i], name, sizeof(name)));
+      write_code_load(f, sym, code + i * TRAMPOLINE_SIZE, i);
+    }
+  write_code_load(f, "I2L:unknown", code + count * TRAMPOLINE_SIZE, count);
+  fclose(f);  // the mapping keeps the file open
+}
+
+
+void perfmap_start(void)
+{
+#if defined(__x86_64__)
+  uint16_t *procs;
+  int count = 0;
+  int i;
+
+  procs = malloc(MAX_MEM * sizeof(uint16_t));
+  trampolines = calloc(MAX_MEM, sizeof(trampoline_fn *));
+  if (! procs || ! trampolines)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+  for (i = 0; i < MAX_MEM; i++)
+    if (code_flags[i] & CF_PROC)
+      procs[count++] = i;
+
+  code_size = (count + 1) * TRAMPOLINE_SIZE;
+  code = mmap(NULL, code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+    fatal_error(ERR_INTERNAL_ERROR, "can't allocate trampolines");
+  for (i = 0; i <= count; i++)
+    emit_trampoline(code + i * TRAMPOLINE_SIZE, perfmap_run);
+  if (mprotect(code, code_size, PROT_READ | PROT_EXEC))
+    fatal_error(ERR_INTERNAL_ERROR, "can't protect trampolines");
+  for (i = 0; i < count; i++)
+    trampolines[procs[i]] = (trampoline_fn *) (code + i * TRAMPOLINE_SIZE);
+  unknown = (trampoline_fn *) (code + count * TRAMPOLINE_SIZE);
+
+  if (perfmap_file)
+    write_perf_map(procs, count);
+  if (perfmap_jitdump)
+    write_jitdump(procs, count);
+  free(procs);
+  perfmap = true;
+#else
+  fatal_error(ERR_BAD_CMD_LINE, "--perf-map and --jitdump are only supported on x86-64");
+#endif
+}
@@ -0,0 +1,166 @@
+// I2L interpreter - sampling profiler
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// A SIGPROF interval timer samples the procedure call chain, which is
+// recovered by walking the heap frames laid out by do_call().  Each
+// distinct chain is counted in a fixed size hash table, since the
+// signal handler can't allocate memory.  At exit the counts are
+// written in the "collapsed stack" format used by flame graph tools:
+//   main;outer;inner 42
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "i2l.h"
+
+
+char *profile_fn;
+int profile_hz = 1000;
+bool profile_pc;  // also key samples by the PC within the procedure
+
+typedef struct
+{
+  uint32_t count;
+  uint16_t pc;
+  uint16_t depth;
+  uint16_t proc[MAX_FRAMES];  // innermost first
+} stack_sample_t;
+
+#define PROFILE_TABLE_SIZE 16384  // must be a power of two
+
+static stack_sample_t *table;
+static volatile uint32_t samples;
+static volatile uint32_t dropped;
+
+
+static uint32_t hash_stack(uint16_t pc, frame_t *frames, int depth)
+{
+  uint32_t h = 2166136261u;
+  int i;
+
+  h = (h ^ pc) * 16777619u;
+  for (i = 0; i < depth; i++)
+    h = (h ^ frames[i].proc) * 16777619u;
+  return h;
+}
+
+
+static bool same_stack(stack_sample_t *s, uint16_t pc, frame_t *frames, int depth)
+{
+  int i;
+
+  if ((s->pc != pc) || (s->depth != depth))
+    return false;
+  for (i = 0; i < depth; i++)
+    if (s->proc[i] != frames[i].proc)
+      return false;
+  return true;
+}
+
+
+static void profile_handler(int sig)
+{
+  frame_t frames[MAX_FRAMES];
+  int depth;
+  uint16_t sample_pc;
+  uint32_t h;
+  int i;
+
+  (void) sig;
+  if (! run)
+    return;
+
+  depth = walk_frames(frames, MAX_FRAMES);
+  sample_pc = profile_pc ? pc : 0;
+  h = hash_stack(sample_pc, frames, depth);
+  for (i = 0; i < PROFILE_TABLE_SIZE; i++)
+    {
+      stack_sample_t *s = & table[(h + i) & (PROFILE_TABLE_SIZE - 1)];
+      if (! s->count)
+	{
+	  s->pc = sample_pc;
+	  s->depth = depth;
+	  for (int j = 0; j < depth; j++)
+	    s->proc[j] = frames[j].proc;
+	  s->count = 1;
+	  samples++;
+	  return;
+	}
+      if (same_stack(s, sample_pc, frames, depth))
+	{
+	  s->count++;
+	  samples++;
+	  return;
+	}
+    }
+  dropped++;
+}
+
+
+void profile_write(void)
+{
+  struct itimerval it;
+  FILE *f;
+  char name[64];
+  int i, j;
+
+  memset(& it, 0, sizeof(it));
+  setitimer(ITIMER_PROF, & it, NULL);
+
+  f = fopen(profile_fn, "w");
+  if (! f)
+    {
+      fprintf(stderr, "%s: can't open profile file %s\n", progname, profile_fn);
+      return;
+    }
+  for (i = 0; i < PROFILE_TABLE_SIZE; i++)
+    {
+      stack_sample_t *s = & table[i];
+      if (! s->count)
+	continue;
+      if (s->depth == MAX_FRAMES)
+	fprintf(f, "[truncated];");
+      else if (! s->depth)
+	fprintf(f, "[unknown]");  // caught in the middle of a call or return
+      for (j = s->depth - 1; j >= 0; j--)
+	fprintf(f, "%s%s", proc_name(s->proc[j], name, sizeof(name)), j ? ";" : "");
+      if (profile_pc)
+	fprintf(f, ";%s", code_name(s->pc, name, sizeof(name)));
+      fprintf(f, " %" PRIu32 "\n", s->count);
+    }
+  fclose(f);
+
+  if (dropped)
+    fprintf(stderr, "%s: profile table full, %" PRIu32 " of %" PRIu32 " samples dropped\n",
+	    progname, dropped, samples + dropped);
+}
+
+
+void profile_start(void)
+{
+  struct sigaction sa;
+  struct itimerval it;
+
+  table = calloc(PROFILE_TABLE_SIZE, sizeof(stack_sample_t));
+  if (! table)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+
+  memset(& sa, 0, sizeof(sa));
+  sa.sa_handler = profile_handler;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, & sa, NULL);
+
+  memset(& it, 0, sizeof(it));
+  it.it_interval.tv_sec = 0;
+  it.it_interval.tv_usec = 1000000 / profile_hz;
+  it.it_value = it.it_interval;
+  setitimer(ITIMER_PROF, & it, NULL);
+
+  atexit(profile_write);
+}
@@ -0,0 +1,183 @@
+// I2L interpreter - recording and replaying input
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// --record FILE logs every value read by CHIN, NUMIN and HEXIN, from
+// any device, and every RAN and CHKKEY result, each with the
+// instruction count at which it was read.  --replay FILE returns the
+// logged values instead of reading the devices or calling rand(), so
+// that a run can be repeated exactly, under a profiler or a trace,
+// without its input files or console.  Opening a device is logged,
+// and so is failing to read one, so that a program trapping the error
+// replays the same.
+//
+// The log is text, one event per line:
+//   <instruction count> <kind> <device> <value> <bytes read>
+// where the kind is c for CHIN, d for NUMIN, x for HEXIN, r for RAN,
+// whose device is its range, o for OPENI, whose value is 1 if it
+// failed, k for CHKKEY, and e for a read from a device that can't be
+// read.  CHIN at end of file has the value -1.
+//
+// A replay whose reads don't match the log, in kind and device, stops
+// with an error.  One whose instruction counts differ only gets a
+// warning, as it may be of an optimized image of the same program.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+bool recording;
+bool replaying;
+char *record_fn;
+char *replay_fn;
+
+static FILE *record_f;
+static FILE *replay_f;
+static const char *replay_name;  // for errors
+static uint64_t events;
+static bool warned;
+
+typedef struct
+{
+  uint64_t count;
+  char kind;
+  int dev;
+  int value;
+  int bytes;
+} event_t;
+
+
+void record_input(char kind, uint16_t dev, int value, int bytes)
+{
+  fprintf(record_f, "%" PRIu64 " %c %u %d %d\n", insn_count, kind, dev, value, bytes);
+}
+
+
+void record_error(uint16_t dev)
+{
+  if (recording)
+    record_input('e', dev, 0, 0);
+}
+
+
+// The next event is only read when it's needed, as the log may be a
+// pipe from a run that's still going, see diffeng.c.
+static event_t next;
+static bool have_next;
+
+static bool peek_event(void)
+{
+  if (! have_next)
+    have_next = fscanf(replay_f, "%" SCNu64 " %c %d %d %d",
+		       & next.count, & next.kind, & next.dev, & next.value, & next.bytes) == 5;
+  return have_next;
+}
+
+static void read_event(event_t *e)
+{
+  if (! peek_event())
+    fatal_error(ERR_IO_ERROR, "replay log %s ended at instruction %" PRIu64, replay_name, insn_count);
+  events++;
+  *e = next;
+  have_next = false;
+}
+
+static void check_event(event_t *e, char kind, uint16_t dev)
+{
+  if ((e->kind != kind) || (e->dev != dev))
+    fatal_error(ERR_IO_ERROR, "replay diverged at instruction %" PRIu64 ": %c %u, but event %" PRIu64 " of the log is %c %d",
+		insn_count, kind, dev, events, e->kind, e->dev);
+  if ((e->count != insn_count) && ! warned)
+    {
+      fprintf(stderr, "%s: replay is at instruction %" PRIu64 " at event %" PRIu64 ", logged at %" PRIu64 "\n",
+	      progname, insn_count, events, e->count);
+      warned = true;
+    }
+}
+
+
+// Returns false if the read failed with an error that was trapped,
+// and nothing was read.  NUMIN and HEXIN go on to read the console
+// after such an error, so the log then has the console read.
+bool replay_input(char kind, uint16_t dev, int *value, int *bytes)
+{
+  event_t e;
+
+  if (peek_event() && (next.kind == 'e'))
+    {
+      read_event(& e);
+      check_event(& e, 'e', dev);
+      runtime_error(ERR_IO_ERROR, "can't read from device %d", dev);
+      if (kind == 'c')
+	return false;
+    }
+  read_event(& e);
+  check_event(& e, kind, dev);
+  *value = e.value;
+  if (bytes)
+    *bytes = e.bytes;
+  return true;
+}
+
+
+int replay_ran(uint16_t range)
+{
+  event_t e;
+
+  read_event(& e);
+  check_event(& e, 'r', range);
+  return e.value;
+}
+
+
+void record_start(void)
+{
+  if (record_fn)
+    {
+      record_f = fopen(record_fn, "w");
+      if (! record_f)
+	fatal_error(ERR_IO_ERROR, "can't create %s", record_fn);
+      recording = true;
+    }
+  if (replay_fn)
+    {
+      replay_f = fopen(replay_fn, "r");
+      if (! replay_f)
+	fatal_error(ERR_IO_ERROR, "can't open %s", replay_fn);
+      replay_name = replay_fn;
+      replaying = true;
+    }
+}
+
+
+// For diffeng.c, whose fast engine passes its input to the reference
+// engine through a pipe.
+void record_stream(FILE *f)
+{
+  record_f = f;
+  recording = true;
+}
+
+void record_flush(void)
+{
+  fflush(record_f);
+}
+
+void record_end(void)
+{
+  fclose(record_f);
+  recording = false;
+}
+
+void replay_stream(FILE *f)
+{
+  replay_f = f;
+  replay_name = "from the fast engine";
+  warned = true;  // the engines run different numbers of instructions
+  replaying = true;
+}
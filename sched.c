@@ -0,0 +1,536 @@
+// I2L interpreter - cooperative VM scheduler
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// With --vms, a daemon worker multiplexes up to that many VMs rather
+// than running one request at a time.  A VM runs until it has
+// executed a quantum of instructions, or until CHIN, NUMIN or HEXIN
+// finds no console input ready, and then yields at an instruction
+// boundary.  The interpreter state is global, so the worker switches
+// VMs by saving the registers and memory of one and restoring those
+// of the next; a VM that runs again straight away isn't copied.
+//
+// An epoll loop accepts connections and collects what the clients
+// send into a buffer for each VM, from which device 0 reads, and
+// resumes the VMs that were waiting for it.  Console output is
+// flushed whenever a VM yields.  A VM's --timeout is a deadline
+// checked when it runs, and once a second while it waits for input.
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "i2l.h"
+
+
+int sched_vms = 1;
+uint64_t sched_quantum = 100000;
+
+typedef enum
+{
+  VM_REQUEST,  // waiting for the request line
+  VM_START,    // queued to start
+  VM_READY,    // queued to resume
+  VM_INPUT,    // waiting for console input
+} vm_state_t;
+
+#define MAX_REQUEST 1024
+#define INPUT_SIZE 4096
+#define MAX_EVENTS 64
+
+typedef struct vm
+{
+  struct vm *next;  // run queue
+  int slot;         // index in vms[]
+  vm_state_t state;
+  int conn;
+  bool polled;      // conn is in the epoll set
+  time_t deadline;
+  bool bad_request;
+  char request[MAX_REQUEST];
+
+  // console input not yet read by the program
+  char input[INPUT_SIZE];
+  size_t in_start;
+  size_t in_end;
+  bool in_eof;
+
+  // saved interpreter state
+  const vmem_t *image;  // the program's, shared
+  vmem_t mem;           // pages that differ from the image
+  uint8_t *xmem;
+  uint32_t xmem_top;
+#ifdef GUARD_STACK
+  uint8_t stack[INITIAL_STACK + 1 - STACK_MIN];
+#endif
+  uint16_t pc;
+  uint16_t sp;
+  uint16_t hp;
+  uint16_t heap_start;
+  uint16_t display[MAX_LEVEL];
+  int level;
+  bool rerun;
+  bool trap;
+  int err;
+  int16_t div_remainder;
+  uint64_t insn_count;
+  FILE *con_in;
+  FILE *con_out;
+  char *disk_in_fn;
+  FILE *disk_in_f;
+  char *disk_out_fn;
+  FILE *disk_out_f;
+  char error_str[sizeof(error_str)];
+} vm_t;
+
+static vm_t **vms;
+static int vm_count;
+static vm_t *current;  // VM whose state is in the interpreter globals
+static vm_t *queue_head;
+static vm_t *queue_tail;
+
+static int epfd;
+static int listen_sock;
+static bool listening;
+
+
+static void vm_save(vm_t *vm)
+{
+  vmem_capture(& vm->mem, vm->image);
+#ifdef GUARD_STACK
+  save_stack(vm->stack);
+#endif
+  vm->xmem = xmem;
+  vm->xmem_top = xmem_top;
+  vm->pc = pc;
+  vm->sp = sp;
+  vm->hp = hp;
+  vm->heap_start = heap_start;
+  memcpy(vm->display, display, sizeof(display));
+  vm->level = level;
+  vm->rerun = rerun;
+  vm->trap = trap;
+  vm->err = err;
+  vm->div_remainder = div_remainder;
+  vm->insn_count = insn_count;
+  vm->con_in = con_in;
+  vm->con_out = con_out;
+  vm->disk_in_fn = disk_in_fn;
+  vm->disk_in_f = disk_in_f;
+  vm->disk_out_fn = disk_out_fn;
+  vm->disk_out_f = disk_out_f;
+  memcpy(vm->error_str, error_str, sizeof(error_str));
+}
+
+
+static void vm_restore(vm_t *vm)
+{
+  vmem_restore(& vm->mem, vm->image);
+#ifdef GUARD_STACK
+  restore_stack(vm->stack);
+#endif
+  xmem = vm->xmem;
+  xmem_top = vm->xmem_top;
+  pc = vm->pc;
+  sp = vm->sp;
+  hp = vm->hp;
+  heap_start = vm->heap_start;
+  memcpy(display, vm->display, sizeof(display));
+  level = vm->level;
+  rerun = vm->rerun;
+  trap = vm->trap;
+  err = vm->err;
+  div_remainder = vm->div_remainder;
+  insn_count = vm->insn_count;
+  con_in = vm->con_in;
+  con_out = vm->con_out;
+  disk_in_fn = vm->disk_in_fn;
+  disk_in_f = vm->disk_in_f;
+  disk_out_fn = vm->disk_out_fn;
+  disk_out_f = vm->disk_out_f;
+  memcpy(error_str, vm->error_str, sizeof(error_str));
+}
+
+
+// Gives the interpreter the state of vm, or of no VM.
+static void vm_switch(vm_t *vm)
+{
+  if (current == vm)
+    return;
+  if (current)
+    vm_save(current);
+  if (vm)
+    vm_restore(vm);
+  current = vm;
+}
+
+
+static void vm_enqueue(vm_t *vm, vm_state_t state)
+{
+  vm->state = state;
+  vm->next = NULL;
+  if (queue_tail)
+    queue_tail->next = vm;
+  else
+    queue_head = vm;
+  queue_tail = vm;
+}
+
+
+static vm_t *vm_dequeue(void)
+{
+  vm_t *vm = queue_head;
+  queue_head = vm->next;
+  if (! queue_head)
+    queue_tail = NULL;
+  return vm;
+}
+
+
+static void poll_fd(int fd, void *ptr, uint32_t events, bool on)
+{
+  struct epoll_event ev;
+
+  memset(& ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = ptr;
+  if (epoll_ctl(epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, & ev) < 0)
+    fatal_error(ERR_INTERNAL_ERROR, "epoll_ctl failed");
+}
+
+
+static void poll_conn(vm_t *vm, bool on)
+{
+  if (vm->polled != on)
+    poll_fd(vm->conn, vm, EPOLLIN, on);
+  vm->polled = on;
+}
+
+
+// Every worker polls the listening socket, but only one is woken for
+// each connection.
+static void poll_listen(bool on)
+{
+  if (listening != on)
+    poll_fd(listen_sock, NULL, EPOLLIN | EPOLLEXCLUSIVE, on);
+  listening = on;
+}
+
+
+// Device 0 input stream of a VM.  Reading an empty buffer before the
+// client has closed its end is an error, which console_ready() sees.
+static ssize_t console_read(void *cookie, char *buf, size_t size)
+{
+  vm_t *vm = cookie;
+  size_t n = vm->in_end - vm->in_start;
+
+  if (! n)
+    {
+      if (vm->in_eof)
+	return 0;
+      errno = EAGAIN;
+      return -1;
+    }
+  if (n > size)
+    n = size;
+  memcpy(buf, & vm->input[vm->in_start], n);
+  vm->in_start += n;
+  return n;
+}
+
+
+// The stream is unbuffered, so that the input buffer is all there is
+// to look at, apart from a character pushed back by NUMIN or HEXIN.
+static FILE *console_open(vm_t *vm)
+{
+  cookie_io_functions_t io = { .read = console_read };
+  FILE *f = fopencookie(vm, "r", io);
+
+  if (f)
+    setvbuf(f, NULL, _IONBF, 0);
+  return f;
+}
+
+
+static bool console_ready(char conversion)
+{
+  vm_t *vm = current;
+  size_t i = vm->in_start;
+  int c;
+
+  if (vm->in_eof)
+    return true;
+
+  if (conversion == 'c')
+    {
+      c = fgetc(con_in);
+      if (c != EOF)
+	{
+	  ungetc(c, con_in);
+	  return true;
+	}
+      clearerr(con_in);
+      return false;
+    }
+
+  // a number is complete once something follows its digits
+  while ((i < vm->in_end) && isspace((unsigned char) vm->input[i]))
+    i++;
+  if ((i < vm->in_end) && ((vm->input[i] == '-') || (vm->input[i] == '+')))
+    i++;
+  while ((i < vm->in_end) &&
+	 (conversion == 'x' ? isxdigit((unsigned char) vm->input[i])
+	                    : isdigit((unsigned char) vm->input[i])))
+    i++;
+  return (i < vm->in_end) || (vm->in_end - vm->in_start == INPUT_SIZE);
+}
+
+
+// Takes the request line from the front of the input buffer, once
+// it is all there.
+static void check_request(vm_t *vm)
+{
+  size_t avail = vm->in_end - vm->in_start;
+  char *line = & vm->input[vm->in_start];
+  char *nl = memchr(line, '\n', avail);
+  size_t len = nl ? (size_t) (nl - line) : avail;
+
+  if (len >= MAX_REQUEST - 1)
+    vm->bad_request = true;
+  else if (nl)
+    {
+      memcpy(vm->request, line, len);
+      vm->request[len] = '\0';
+      vm->in_start += len + 1;
+    }
+  else if (vm->in_eof)
+    vm->bad_request = true;
+  else
+    return;
+  vm_enqueue(vm, VM_START);
+}
+
+
+static void read_input(vm_t *vm)
+{
+  ssize_t n;
+
+  if (vm->in_start)
+    {
+      memmove(vm->input, & vm->input[vm->in_start], vm->in_end - vm->in_start);
+      vm->in_end -= vm->in_start;
+      vm->in_start = 0;
+    }
+  if (vm->in_end == INPUT_SIZE)
+    {
+      // polled again once the program has read some
+      poll_conn(vm, false);
+      return;
+    }
+
+  n = recv(vm->conn, & vm->input[vm->in_end], INPUT_SIZE - vm->in_end, MSG_DONTWAIT);
+  if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+    return;
+  if (n <= 0)
+    {
+      vm->in_eof = true;
+      poll_conn(vm, false);
+    }
+  else
+    vm->in_end += n;
+
+  if (vm->state == VM_REQUEST)
+    check_request(vm);
+  else if (vm->state == VM_INPUT)
+    vm_enqueue(vm, VM_READY);
+}
+
+
+static void accept_connections(void)
+{
+  while (vm_count < sched_vms)
+    {
+      vm_t *vm;
+      int conn = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+      if (conn < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return;  // another worker took it
+	}
+      vm = calloc(1, sizeof(vm_t));
+      if (! vm)
+	fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+      vm->conn = conn;
+      vm->state = VM_REQUEST;
+      vm->slot = vm_count;
+      vms[vm_count++] = vm;
+      poll_conn(vm, true);
+    }
+  poll_listen(false);
+}
+
+
+// Called with the finished VM's state in the interpreter.
+static void vm_finish(vm_t *vm)
+{
+  if (con_out)
+    daemon_finish();
+  current = NULL;
+  free(xmem);
+  xmem = NULL;
+
+  poll_conn(vm, false);
+  close(vm->conn);
+  vms[vm->slot] = vms[--vm_count];
+  vms[vm->slot]->slot = vm->slot;
+  vmem_free(& vm->mem);
+  free(vm);
+
+  poll_listen(true);
+}
+
+
+// Sets up the interpreter for a new request, returning false if it
+// can't be run.
+static bool vm_start(vm_t *vm)
+{
+  vm_switch(NULL);
+  current = vm;
+  xmem = NULL;  // each VM has its own
+  con_in = NULL;
+  disk_in_fn = NULL;
+  disk_in_f = NULL;
+  disk_out_fn = NULL;
+  disk_out_f = NULL;
+  error_str[0] = '\0';
+
+  con_out = fdopen(dup(vm->conn), "w");
+  if (! con_out)
+    return false;
+  if (vm->bad_request)
+    {
+      fprintf(con_out, "%s: bad request\n", progname);
+      return false;
+    }
+  if (! daemon_request(vm->request))
+    return false;
+  vm->image = daemon_image;
+  con_in = console_open(vm);
+  if (! con_in)
+    return false;
+
+  insn_count = 0;
+  vm->deadline = time(NULL) + timeout_secs;
+  return true;
+}
+
+
+static void vm_run(vm_t *vm)
+{
+  bool start = (vm->state == VM_START);
+
+  if (start)
+    {
+      if (! vm_start(vm))
+	{
+	  vm_finish(vm);
+	  return;
+	}
+    }
+  else
+    vm_switch(vm);
+
+  watchdog_set(timeout_secs && (time(NULL) >= vm->deadline));
+  yield_count = insn_count + sched_quantum;
+  error_longjmp = true;
+  if (start)
+    interp();
+  else
+    interp_resume();
+  error_longjmp = false;
+  fflush(con_out);
+
+  switch (yielded)
+    {
+    case YIELD_NONE:
+      vm_finish(vm);
+      break;
+    case YIELD_QUANTUM:
+      vm_enqueue(vm, VM_READY);
+      break;
+    case YIELD_INPUT:
+      vm->state = VM_INPUT;
+      poll_conn(vm, true);
+      break;
+    }
+}
+
+
+// Resumes the VMs whose time ran out while they waited for input,
+// so that they stop with a timeout error.
+static void check_deadlines(void)
+{
+  static time_t last;
+  time_t now = time(NULL);
+  int i;
+
+  if (! timeout_secs || (now == last))
+    return;
+  last = now;
+  for (i = 0; i < vm_count; i++)
+    if ((vms[i]->state == VM_INPUT) && (now >= vms[i]->deadline))
+      vm_enqueue(vms[i], VM_READY);
+}
+
+
+noreturn void sched_worker(int sock)
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  signal(SIGPIPE, SIG_IGN);
+
+  vms = calloc(sched_vms, sizeof(vm_t *));
+  if (! vms)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0)
+    fatal_error(ERR_INTERNAL_ERROR, "can't create epoll instance");
+  listen_sock = sock;
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  poll_listen(true);
+  con_ready = console_ready;
+
+  while (true)
+    {
+      int timeout = queue_head ? 0 : (timeout_secs ? 1000 : -1);
+      int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+      int i;
+
+      if ((n < 0) && (errno != EINTR))
+	fatal_error(ERR_INTERNAL_ERROR, "epoll_wait failed");
+      for (i = 0; i < n; i++)
+	{
+	  if (events[i].data.ptr)
+	    read_input(events[i].data.ptr);
+	  else
+	    accept_connections();
+	}
+      check_deadlines();
+
+      if (queue_head)
+	vm_run(vm_dequeue());
+    }
+}
@@ -0,0 +1,208 @@
+// I2L interpreter - resident compile server
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// In server mode the program runs normally until the first time it
+// asks for input from device 0 or touches device 3.  At that point
+// its tables are initialized, so the process stops and listens on a
+// Unix domain socket.  Each connection gets a fork()ed, and thus
+// copy-on-write, copy of the interpreter state, with device 0
+// connected to the socket and device 3 connected to the files named
+// by the request.
+//
+// Request format, sent by the client:
+//   <input file> <output file>\n
+// followed by whatever should be read from device 0.  Either file
+// name may be "-" if not needed.  Everything written to device 0
+// (and any error message) is sent back over the socket, preceded by
+// any output the program wrote before the checkpoint.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "i2l.h"
+
+
+char *server_socket_fn;
+bool server_pending;
+
+static int preamble_fd = -1;
+static int saved_stdout_fd = -1;
+
+#define MAX_REQUEST 1024
+
+
+// Called before the program starts.  Output written before the
+// checkpoint is captured so that it can be replayed to each client.
+void server_init(void)
+{
+  FILE *f = tmpfile();
+  if (! f)
+    fatal_error(ERR_IO_ERROR, "can't create server preamble file");
+  preamble_fd = dup(fileno(f));
+  fclose(f);
+
+  fflush(stdout);
+  saved_stdout_fd = dup(STDOUT_FILENO);
+  if ((preamble_fd < 0) || (saved_stdout_fd < 0) ||
+      (dup2(preamble_fd, STDOUT_FILENO) < 0))
+    fatal_error(ERR_IO_ERROR, "can't redirect server output");
+
+  server_pending = true;
+}
+
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len)
+    {
+      ssize_t r = write(fd, p, len);
+      if (r < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return false;
+	}
+      p += r;
+      len -= r;
+    }
+  return true;
+}
+
+
+static void send_preamble(int fd)
+{
+  char buf[4096];
+  ssize_t r;
+  off_t pos = 0;
+
+  while ((r = pread(preamble_fd, buf, sizeof(buf), pos)) > 0)
+    {
+      if (! write_all(fd, buf, r))
+	return;
+      pos += r;
+    }
+}
+
+
+// Reads the request line one byte at a time, so that nothing after
+// the newline is consumed; that belongs to device 0.
+static bool read_request(int fd, char *in_fn, char *out_fn)
+{
+  char line[MAX_REQUEST];
+  size_t len = 0;
+
+  while (true)
+    {
+      char c;
+      ssize_t r = read(fd, & c, 1);
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r <= 0)
+	return false;
+      if (c == '\n')
+	break;
+      if (len >= sizeof(line) - 1)
+	return false;
+      line[len++] = c;
+    }
+  line[len] = '\0';
+
+  return sscanf(line, "%1023s %1023s", in_fn, out_fn) == 2;
+}
+
+
+// Runs in the child: redirect devices 0 and 3, then return to the
+// interpreter, which carries on from the checkpoint.
+static void serve_request(int conn)
+{
+  char in_fn[MAX_REQUEST];
+  char out_fn[MAX_REQUEST];
+
+  if (! read_request(conn, in_fn, out_fn))
+    {
+      static const char msg[] = "bad request\n";
+      (void) write_all(conn, msg, sizeof(msg) - 1);
+      _exit(ERR_BAD_CMD_LINE);
+    }
+
+  send_preamble(conn);
+  close(preamble_fd);
+
+  if ((dup2(conn, STDIN_FILENO) < 0) ||
+      (dup2(conn, STDOUT_FILENO) < 0) ||
+      (dup2(conn, STDERR_FILENO) < 0))
+    _exit(ERR_IO_ERROR);
+  close(conn);
+
+  disk_in_fn = strcmp(in_fn, "-") ? strdup(in_fn) : NULL;
+  disk_out_fn = strcmp(out_fn, "-") ? strdup(out_fn) : NULL;
+
+  server_pending = false;
+  watchdog_start();
+}
+
+
+// Called from the input and device 3 intrinsics while server_pending
+// is set.  Only returns in a child process.
+void server_checkpoint(void)
+{
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  int sock;
+
+  fflush(stdout);
+  if (dup2(saved_stdout_fd, STDOUT_FILENO) < 0)
+    fatal_error(ERR_IO_ERROR, "can't restore server output");
+  close(saved_stdout_fd);
+
+  if (strlen(server_socket_fn) >= sizeof(addr.sun_path))
+    fatal_error(ERR_BAD_CMD_LINE, "server socket name too long");
+  memset(& addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, server_socket_fn);
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    fatal_error(ERR_IO_ERROR, "can't create server socket");
+  unlink(server_socket_fn);
+  if (bind(sock, (struct sockaddr *) & addr, sizeof(addr)) < 0)
+    fatal_error(ERR_IO_ERROR, "can't bind server socket %s", server_socket_fn);
+  if (listen(sock, 16) < 0)
+    fatal_error(ERR_IO_ERROR, "can't listen on server socket");
+
+  // let the kernel reap the children
+  memset(& sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  sa.sa_flags = SA_NOCLDWAIT;
+  sigaction(SIGCHLD, & sa, NULL);
+
+  while (true)
+    {
+      int conn = accept(sock, NULL, NULL);
+      if (conn < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal_error(ERR_IO_ERROR, "accept failed on server socket");
+	}
+
+      pid_t pid = fork();
+      if (pid == 0)
+	{
+	  close(sock);
+	  serve_request(conn);
+	  return;
+	}
+      close(conn);
+    }
+}
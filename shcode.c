@@ -0,0 +1,296 @@
+// I2L interpreter - code shared between runs of a program
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// Every run of a program loads the same code, and analyze_code(),
+// convert_cases(), convert_idioms() and convert_texts() derive the
+// same flags, blocks and tables from it.  With --shared-code the first
+// run publishes all of that in a POSIX shared memory segment named by
+// a hash of the image file and of the options that change the
+// conversions, such as /dev/shm/i2l-code-<hash>, and later runs,
+// concurrent or not, attach to it instead of loading.  The segment is
+// created read-only, and as its name can be worked out by anyone with
+// the image, a run only uses one that its own user made, that no one
+// else can write, and whose tables check out.  Its code pages are
+// mapped privately over mem[], so that they're shared by every run
+// until a program writes into its own code, when the kernel copies
+// just the page written; the tables are used in place.  The symbol map
+// is still read from the image file, which has to be read anyway to
+// hash it.
+//
+// The segment's magic number is stored last, so a run that finds one
+// still being written loads the program itself.  A segment stays
+// until it's removed or the machine restarts; a changed image gets a
+// segment of its own.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "i2l.h"
+
+
+bool shared_code;
+
+#define SHCODE_MAGIC UINT64_C(0x31454430434c3249)  // "I2LC0DE1"
+#define SHCODE_VERSION 2
+
+typedef struct
+{
+  uint64_t magic;        // stored last
+  uint64_t key;
+  uint64_t size;
+  uint32_t heap_start;
+  uint32_t mem_lo;       // mem[mem_lo..mem_hi) is mapped from mem_off
+  uint32_t mem_hi;
+  uint32_t mem_off;
+  uint32_t flags_off;    // code_flags[CODE_START..heap_start)
+  uint32_t blocks_off;
+  uint32_t block_count;
+  uint32_t cases_off;
+  uint32_t idioms_off;
+  uint32_t texts_off;
+} shcode_header_t;
+
+
+static size_t align(size_t n, size_t to)
+{
+  return (n + to - 1) & ~(to - 1);
+}
+
+
+// FNV-1a
+static uint64_t hash(uint64_t h, const void *p, size_t len)
+{
+  const uint8_t *b = p;
+
+  while (len--)
+    h = (h ^ *b++) * UINT64_C(0x100000001b3);
+  return h;
+}
+
+static uint64_t image_key(const uint8_t *image, size_t len, long page)
+{
+  uint32_t config[] = { SHCODE_VERSION, page, case_tables, loop_idioms,
+			text_index, sizeof(block_t), MAX_MEM };
+
+  return hash(hash(UINT64_C(0xcbf29ce484222325), config, sizeof(config)), image, len);
+}
+
+
+// True if the blocks are those analyze_code() could have found, in
+// order, each with at most two successors.
+static bool blocks_valid(const block_t *b, uint32_t count)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; i++)
+    if ((b[i].start < CODE_START) || (b[i].end <= b[i].start) ||
+	(b[i].nsucc < 0) || (b[i].nsucc > 2) ||
+	(i && (b[i].start < b[i - 1].end)))
+      return false;
+  return true;
+}
+
+// A section of the segment from off to next, if it's in order.
+static bool section(const shcode_header_t *h, uint32_t off, uint32_t next, size_t min)
+{
+  return ! (off % 8) && (off <= next) && (next <= h->size) && (next - off >= min);
+}
+
+// True if the header describes a segment that publish() could have
+// made with this page size, and every table in it can be used.
+static bool header_valid(const shcode_header_t *h, const uint8_t *seg, long page)
+{
+  if ((h->heap_start <= CODE_START) || (h->heap_start > MAX_MEM) ||
+      (h->mem_lo != (CODE_START & ~(page - 1))) ||
+      (h->mem_hi != align(h->heap_start, page)) || (h->mem_hi > MAX_MEM) ||
+      (h->mem_off % page) || (h->mem_off > h->size) ||
+      (h->size - h->mem_off != h->mem_hi - h->mem_lo))
+    return false;
+  if ((h->flags_off < sizeof(*h)) ||
+      ! section(h, h->flags_off, h->blocks_off, h->heap_start - CODE_START) ||
+      ! section(h, h->blocks_off, h->cases_off, (size_t) h->block_count * sizeof(block_t)) ||
+      ! section(h, h->cases_off, h->idioms_off, 0) ||
+      ! section(h, h->idioms_off, h->texts_off, 0) ||
+      ! section(h, h->texts_off, h->mem_off, 0))
+    return false;
+  return blocks_valid((const block_t *) (seg + h->blocks_off), h->block_count) &&
+    cases_valid(seg + h->cases_off, h->idioms_off - h->cases_off) &&
+    idioms_valid(seg + h->idioms_off, h->texts_off - h->idioms_off) &&
+    texts_valid(seg + h->texts_off, h->mem_off - h->texts_off);
+}
+
+
+// Only a segment that this user made, and no one else can write, is
+// used; any other, or one that doesn't check out, is left alone and
+// the program loaded as usual.
+static bool attach(const char *name, uint64_t key, long page)
+{
+  const shcode_header_t *h;
+  struct stat st;
+  uint8_t *seg;
+  int fd;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+  if (fstat(fd, & st) || ! S_ISREG(st.st_mode) ||
+      (st.st_uid != geteuid()) || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+      (st.st_size < (off_t) sizeof(*h)))
+    {
+      close(fd);
+      return false;
+    }
+  seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (seg == MAP_FAILED)
+    {
+      close(fd);
+      return false;
+    }
+  h = (const shcode_header_t *) seg;
+  if ((__atomic_load_n(& h->magic, __ATOMIC_ACQUIRE) != SHCODE_MAGIC) ||
+      (h->key != key) || (h->size != (uint64_t) st.st_size) ||
+      ! header_valid(h, seg, page))
+    {
+      munmap(seg, st.st_size);
+      close(fd);
+      return false;
+    }
+
+  if (mmap(& mem[h->mem_lo], h->mem_hi - h->mem_lo, PROT_READ | PROT_WRITE,
+	   MAP_PRIVATE | MAP_FIXED, fd, h->mem_off) == MAP_FAILED)
+    fatal_error(ERR_INTERNAL_ERROR, "can't map shared code %s", name);
+  close(fd);
+
+  heap_start = h->heap_start;
+  memcpy(& code_flags[CODE_START], seg + h->flags_off, heap_start - CODE_START);
+  blocks = (block_t *) (seg + h->blocks_off);
+  block_count = h->block_count;
+  cases_attach(seg + h->cases_off);
+  idioms_attach(seg + h->idioms_off);
+  texts_attach(seg + h->texts_off);
+  return true;
+}
+
+
+// Nothing is lost if the segment can't be made; the next run tries
+// again.
+static void publish(const char *name, uint64_t key, long page)
+{
+  shcode_header_t h;
+  uint8_t *seg;
+  size_t n;
+  int fd;
+
+  memset(& h, 0, sizeof(h));
+  h.key = key;
+  h.heap_start = heap_start;
+  h.mem_lo = CODE_START & ~(page - 1);
+  h.mem_hi = align(heap_start, page);
+  n = align(sizeof(h), 8);
+  h.flags_off = n;
+  n += align(heap_start - CODE_START, 8);
+  h.blocks_off = n;
+  h.block_count = block_count;
+  n += align(block_count * sizeof(block_t), 8);
+  h.cases_off = n;
+  n += align(cases_save(NULL), 8);
+  h.idioms_off = n;
+  n += align(idioms_save(NULL), 8);
+  h.texts_off = n;
+  n += align(texts_save(NULL), 8);
+  h.mem_off = align(n, page);
+  h.size = h.mem_off + h.mem_hi - h.mem_lo;
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0444);
+  if (fd < 0)
+    return;  // another run got there first
+  if (ftruncate(fd, h.size) ||
+      ((seg = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED))
+    {
+      shm_unlink(name);
+      close(fd);
+      return;
+    }
+  close(fd);
+
+  memcpy(seg + h.flags_off, & code_flags[CODE_START], heap_start - CODE_START);
+  memcpy(seg + h.blocks_off, blocks, block_count * sizeof(block_t));
+  cases_save(seg + h.cases_off);
+  idioms_save(seg + h.idioms_off);
+  texts_save(seg + h.texts_off);
+  memcpy(seg + h.mem_off, & mem[h.mem_lo], h.mem_hi - h.mem_lo);
+  memcpy(seg, & h, sizeof(h));
+  __atomic_store_n(& ((shcode_header_t *) seg)->magic, SHCODE_MAGIC, __ATOMIC_RELEASE);
+  munmap(seg, h.size);
+}
+
+
+// Loads and converts the program in the image file fn, or attaches
+// to the segment another run made of it.
+void shcode_load(const char *fn)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  char name[32];
+  uint8_t *image;
+  uint8_t *dollar;
+  long len;
+  uint64_t key;
+  FILE *f;
+
+  f = fopen(fn, "rb");
+  if (! f)
+    fatal_error(ERR_NO_I2L_FILE, NULL);
+  if (fseek(f, 0, SEEK_END) || ((len = ftell(f)) < 0))
+    fatal_error(ERR_IO_ERROR, "can't read %s", fn);
+  rewind(f);
+  image = malloc(len ? len : 1);
+  if (! image)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+  if (fread(image, 1, len, f) != (size_t) len)
+    fatal_error(ERR_IO_ERROR, "can't read %s", fn);
+  fclose(f);
+
+  key = image_key(image, len, page);
+  snprintf(name, sizeof(name), "/i2l-code-%016" PRIx64, key);
+
+  // a mapping needs mem[] to start on a page
+  if (((uintptr_t) mem % page) || ! attach(name, key, page))
+    {
+      if (! len)
+	fatal_error(ERR_I2L_UNEXPECTED_CHAR, NULL);
+      f = fmemopen(image, len, "rb");
+      if (! f)
+	fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+      loader(f);
+      fclose(f);
+      analyze_code();
+      convert_cases();
+      convert_idioms();
+      convert_texts();
+      if (! ((uintptr_t) mem % page) && (heap_start > CODE_START))
+	publish(name, key, page);
+      free(image);
+      return;
+    }
+
+  // the loader stops at the first '$', as only hex and a few other
+  // characters may come before it
+  dollar = memchr(image, '$', len);
+  if (dollar && (dollar + 1 < image + len))
+    {
+      f = fmemopen(dollar + 1, image + len - (dollar + 1), "rb");
+      if (! f)
+	fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+      load_image_symbols(f);
+      fclose(f);
+    }
+  free(image);
+}
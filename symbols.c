@@ -0,0 +1,262 @@
+// I2L interpreter - procedure symbol map
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// A symbol map is a text file with one symbol per line:
+//   <offset> <name> [<kind>]
+// where <offset> is in hex.  For kind P, the default, the symbol is a
+// procedure and the offset is relative to CODE_START, as in the load
+// address records of the I2L file; for kind G it is a global variable
+// and the offset is within the main program's frame.  Blank lines and
+// lines starting with '#' are ignored.
+//
+// The compiler writes a map in this format after the end of the I2L
+// image when asked, which the loader reads unless a map was given
+// with --symbols.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+typedef struct
+{
+  uint16_t addr;
+  char *name;
+} symbol_t;
+
+typedef struct
+{
+  symbol_t *symbols;
+  int count;
+  int allocated;
+} symbol_table_t;
+
+static symbol_table_t procs;
+static symbol_table_t globals;
+static bool sidecar;  // --symbols given
+
+
+static int symbol_compare(const void *a, const void *b)
+{
+  const symbol_t *sa = a;
+  const symbol_t *sb = b;
+  return (int) sa->addr - (int) sb->addr;
+}
+
+
+static void add_symbol(symbol_table_t *t, uint16_t addr, const char *name)
+{
+  if (t->count == t->allocated)
+    {
+      t->allocated = t->allocated ? t->allocated * 2 : 64;
+      t->symbols = realloc(t->symbols, t->allocated * sizeof(symbol_t));
+      if (! t->symbols)
+	fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+    }
+  t->symbols[t->count].addr = addr;
+  t->symbols[t->count].name = strdup(name);
+  t->count++;
+}
+
+
+static void clear_symbols(symbol_table_t *t)
+{
+  int i;
+  for (i = 0; i < t->count; i++)
+    free(t->symbols[i].name);
+  t->count = 0;
+}
+
+
+// Reads symbol lines up to the end of the file.  After an image,
+// where older tools left other data, anything that isn't a complete
+// map with kinds is ignored.
+static bool read_symbols(FILE *f, const char *fn, bool image)
+{
+  char line[256];
+
+  while (fgets(line, sizeof(line), f))
+    {
+      unsigned int offset;
+      char name[128];
+      char kind = 'P';
+
+      if ((line[0] == '#') || (line[0] == '\n') || (line[0] == '\r'))
+	continue;
+      int fields = sscanf(line, "%x %127s %c", & offset, name, & kind);
+      if (image && (fields < 3))
+	return false;
+      if (fields < 2)
+	fatal_error(ERR_IO_ERROR, "bad line in symbol map %s", fn);
+      if (kind == 'G')
+	add_symbol(& globals, offset, name);
+      else if (kind == 'P')
+	add_symbol(& procs, CODE_START + offset, name);
+      else if (image)
+	return false;
+      else
+	fatal_error(ERR_IO_ERROR, "bad symbol kind in symbol map %s", fn);
+    }
+  qsort(procs.symbols, procs.count, sizeof(symbol_t), symbol_compare);
+  qsort(globals.symbols, globals.count, sizeof(symbol_t), symbol_compare);
+  return true;
+}
+
+
+void load_symbols(char *fn)
+{
+  FILE *f;
+
+  f = fopen(fn, "r");
+  if (! f)
+    fatal_error(ERR_IO_ERROR, "can't open symbol file %s", fn);
+  read_symbols(f, fn, false);
+  fclose(f);
+  sidecar = true;
+}
+
+
+// Called by the loader at the end of the image, where a map written
+// by the compiler follows.  Each image loaded replaces the last one's.
+void load_image_symbols(FILE *f)
+{
+  if (sidecar)
+    return;
+  clear_symbols(& procs);
+  clear_symbols(& globals);
+  if (! read_symbols(f, NULL, true))
+    {
+      clear_symbols(& procs);
+      clear_symbols(& globals);
+    }
+}
+
+
+// Writes the map for an image whose procedures were moved by remap.
+void write_symbols(FILE *f, uint16_t (*remap)(uint16_t addr))
+{
+  int i;
+
+  for (i = 0; i < procs.count; i++)
+    fprintf(f, "\r\n%04" PRIX16 " %s P", (uint16_t) (remap(procs.symbols[i].addr) - CODE_START), procs.symbols[i].name);
+  for (i = 0; i < globals.count; i++)
+    fprintf(f, "\r\n%04" PRIX16 " %s G", globals.symbols[i].addr, globals.symbols[i].name);
+  if (procs.count || globals.count)
+    fprintf(f, "\r\n");
+}
+
+
+static const char *find_symbol(symbol_table_t *t, uint16_t addr)
+{
+  int lo = 0;
+  int hi = t->count - 1;
+
+  while (lo <= hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (t->symbols[mid].addr == addr)
+	return t->symbols[mid].name;
+      if (t->symbols[mid].addr < addr)
+	lo = mid + 1;
+      else
+	hi = mid - 1;
+    }
+  return NULL;
+}
+
+
+bool have_symbols(void)
+{
+  return procs.count > 0;
+}
+
+
+// Returns the name of the procedure at exactly addr, or NULL.
+const char *symbol_name(uint16_t addr)
+{
+  return find_symbol(& procs, addr);
+}
+
+
+// Returns the name of the global variable at the offset, or NULL.
+const char *global_name(uint16_t offset)
+{
+  return find_symbol(& globals, offset);
+}
+
+
+// Finds the addresses of procedures with the name, which can be more
+// than one for a forward declaration, returning how many there are.
+int symbol_addrs(const char *name, uint16_t *addrs, int max)
+{
+  int count = 0;
+  int i;
+
+  for (i = 0; i < procs.count; i++)
+    if (strcmp(procs.symbols[i].name, name) == 0)
+      {
+	if (count < max)
+	  addrs[count] = procs.symbols[i].addr;
+	count++;
+      }
+  return count;
+}
+
+
+// Formats a procedure address for reports, by name if known.
+char *proc_name(uint16_t addr, char *buf, size_t size)
+{
+  const char *name = symbol_name(addr);
+
+  if (name)
+    snprintf(buf, size, "%s", name);
+  else if (addr == CODE_START)
+    snprintf(buf, size, "main");
+  else
+    snprintf(buf, size, "%04" PRIx16, addr);
+  return buf;
+}
+
+
+// Formats a code address for reports as the procedure containing it
+// plus an offset, "SIEVE+0x12", given a symbol map, else in hex.  The
+// containing procedure is the one code analysis assigned the address
+// to, since a procedure's body follows any procedures nested in it.
+char *code_name(uint16_t addr, char *buf, size_t size)
+{
+  int lo = 0;
+  int hi = block_count - 1;
+
+  if (! procs.count)
+    {
+      snprintf(buf, size, "%04" PRIx16, addr);
+      return buf;
+    }
+  while (lo <= hi)
+    {
+      int mid = (lo + hi) / 2;
+      block_t *b = & blocks[mid];
+      if (addr < b->start)
+	hi = mid - 1;
+      else if (addr >= b->end)
+	lo = mid + 1;
+      else
+	{
+	  size_t len;
+	  if (! b->proc)
+	    break;
+	  proc_name(b->proc, buf, size);
+	  len = strlen(buf);
+	  if ((addr != b->proc) && (len < size))
+	    snprintf(buf + len, size - len, "+0x%" PRIx16, (uint16_t) (addr - b->proc));
+	  return buf;
+	}
+    }
+  snprintf(buf, size, "%04" PRIx16, addr);
+  return buf;
+}
@@ -0,0 +1,275 @@
+// I2L interpreter - string literals written by TEXT
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// TEXT writes a string whose last character has its high bit set.  A
+// literal is compiled into the code, jumped over, and passed by
+//   IMM string
+//   CML TEXT
+// At load time each string passed that way is indexed by address,
+// with its length and a copy with the terminator's high bit cleared,
+// so that TEXT writes it with a single fwrite().  The copy is only
+// used while memory still holds the string, which costs a memcmp();
+// otherwise, and for strings built at run time, the terminator is
+// found 16 bytes at a time and the string copied out.
+//
+// The daemon loads several programs into the same memory, so strings
+// at the same address in different programs are chained, as idioms
+// are.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "i2l.h"
+
+
+bool text_index = true;
+
+typedef struct
+{
+  uint32_t offset;      // of the copy in pool[]
+  uint16_t len;         // including the terminator
+  uint16_t next;        // index + 1 of another string at the same address
+} text_t;
+
+#define MAX_TEXTS 4096
+#define MAX_TEXT_POOL 0x10000
+
+static text_t texts[MAX_TEXTS];
+static int text_count;
+static uint8_t pool[MAX_TEXT_POOL];
+static uint32_t pool_used;
+static uint16_t *text_at;  // index + 1 by string address
+
+static uint8_t buf[MAX_MEM];  // strings not indexed are copied here
+
+
+// Offset of the first byte of p[0..len) with the high bit set, or len.
+static size_t terminator(const uint8_t *p, size_t len)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16)
+    {
+      int m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (p + i)));
+      if (m)
+	return i + __builtin_ctz(m);
+    }
+#else
+  for (; i + 8 <= len; i += 8)
+    {
+      uint64_t w;
+      memcpy(& w, p + i, sizeof(w));
+      if (w & UINT64_C(0x8080808080808080))
+	break;
+    }
+#endif
+  for (; i < len; i++)
+    if (p[i] & 0x80)
+      break;
+  return i;
+}
+
+
+// The indexed copy of the string at addr, if memory still holds it.
+static const text_t *lookup(uint16_t addr)
+{
+  const text_t *t;
+  uint16_t i;
+
+  if (! text_at || ! text_index)
+    return NULL;
+  for (i = text_at[addr]; i; i = t->next)
+    {
+      t = & texts[i - 1];
+      if ((memcmp(& mem[addr], & pool[t->offset], t->len - 1) == 0) &&
+	  (mem[addr + t->len - 1] == (pool[t->offset + t->len - 1] | 0x80)))
+	return t;
+    }
+  return NULL;
+}
+
+
+// Sets *s to the string at addr, with the terminator's high bit
+// cleared, and returns its length, terminator included.  A string
+// runs on past the end of memory at address 0.  One with no
+// terminator at all is all of memory, written once.
+size_t text_string(uint16_t addr, const uint8_t **s)
+{
+  const text_t *t = lookup(addr);
+  size_t rest = MAX_MEM - addr;
+  size_t len;
+
+  if (t)
+    {
+      *s = & pool[t->offset];
+      return t->len;
+    }
+
+  len = terminator(& mem[addr], rest);
+  if (len < rest)
+    {
+      len++;
+      memcpy(buf, & mem[addr], len);
+    }
+  else
+    {
+      size_t wrapped = terminator(mem, addr);
+      memcpy(buf, & mem[addr], len);
+      if (wrapped < addr)
+	wrapped++;
+      memcpy(& buf[len], mem, wrapped);
+      len += wrapped;
+    }
+  buf[len - 1] &= 0x7f;
+  *s = buf;
+  return len;
+}
+
+
+// Uses the code flags from analyze_code().
+void convert_texts(void)
+{
+  uint32_t addr;
+
+  if (! text_index)
+    return;
+  if (! text_at)
+    text_at = calloc(MAX_MEM, sizeof(uint16_t));
+  if (! text_at)
+    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+
+  for (addr = CODE_START; addr + 5 <= heap_start; addr++)
+    {
+      text_t *t = & texts[text_count];
+      uint16_t s;
+      int inum;
+      size_t rest, len;
+
+      if (! (code_flags[addr] & CF_INSN) || (mem[addr] != 0x0b) ||  // IMM
+	  ! (code_flags[addr + 3] & CF_INSN) || (mem[addr + 3] != 0x0c))  // CML
+	continue;
+      inum = mem[addr + 4] - INTRINSIC_OFFSET;
+      if ((inum < 0) || (inum >= INTRINSIC_MAX) || ! intrinsic[inum].name ||
+	  (strcmp(intrinsic[inum].name, "text") != 0))
+	continue;
+      s = read16(addr + 1);
+      if (lookup(s))
+	continue;  // passed more than once, or reloaded
+      rest = MAX_MEM - s;
+      len = terminator(& mem[s], rest) + 1;
+      if (len > rest)
+	continue;  // runs past the end of memory
+      if ((text_count == MAX_TEXTS) || (pool_used + len > MAX_TEXT_POOL))
+	break;
+      t->offset = pool_used;
+      t->len = len;
+      memcpy(& pool[pool_used], & mem[s], len);
+      pool[pool_used + len - 1] &= 0x7f;
+      pool_used += len;
+      t->next = text_at[s];
+      text_at[s] = ++text_count;
+    }
+}
+
+
+// Stores the strings and their index at p, unless it's NULL, and
+// returns their size.
+size_t texts_save(uint8_t *p)
+{
+  uint64_t count = text_at ? text_count + 1 : 0;  // 0 if not indexed
+  size_t n = 0;
+
+  if (p)
+    memcpy(p, & count, sizeof(count));
+  n += sizeof(count);
+  if (! text_at)
+    return n;
+  if (p)
+    memcpy(p + n, & pool_used, sizeof(pool_used));
+  n += sizeof(pool_used);
+  if (p)
+    memcpy(p + n, text_at, MAX_MEM * sizeof(uint16_t));
+  n += MAX_MEM * sizeof(uint16_t);
+  if (p)
+    memcpy(p + n, texts, text_count * sizeof(text_t));
+  n += text_count * sizeof(text_t);
+  if (p)
+    memcpy(p + n, pool, pool_used);
+  n += pool_used;
+  return n;
+}
+
+// Uses the strings stored by texts_save(), whose index must stay
+// mapped, instead of indexing them.
+void texts_attach(const uint8_t *p)
+{
+  uint64_t count;
+  size_t n = 0;
+
+  memcpy(& count, p, sizeof(count));
+  n += sizeof(count);
+  if (! count)
+    return;
+  text_count = count - 1;
+  memcpy(& pool_used, p + n, sizeof(pool_used));
+  n += sizeof(pool_used);
+  text_at = (uint16_t *) (p + n);
+  n += MAX_MEM * sizeof(uint16_t);
+  memcpy(texts, p + n, text_count * sizeof(text_t));
+  n += text_count * sizeof(text_t);
+  memcpy(pool, p + n, pool_used);
+}
+
+// True if the strings stored at p fit in len bytes and can be used by
+// text_string(): each fits in memory at the address whose chain holds
+// it, in only that chain, and in the pool.
+bool texts_valid(const uint8_t *p, size_t len)
+{
+  uint64_t count;
+  uint32_t used;
+  uint8_t seen[MAX_TEXTS] = { 0 };
+  const uint8_t *at, *list;
+  uint16_t j;
+  text_t t;
+  uint32_t addr;
+
+  if (len < sizeof(count))
+    return false;
+  memcpy(& count, p, sizeof(count));
+  if (! count)
+    return true;
+  count--;
+  if ((count > MAX_TEXTS) || (len - sizeof(count) < sizeof(used)))
+    return false;
+  memcpy(& used, p + sizeof(count), sizeof(used));
+  if ((used > MAX_TEXT_POOL) ||
+      (len - sizeof(count) - sizeof(used) <
+       MAX_MEM * sizeof(uint16_t) + count * sizeof(text_t) + used))
+    return false;
+  at = p + sizeof(count) + sizeof(used);
+  list = at + MAX_MEM * sizeof(uint16_t);
+  for (addr = 0; addr < MAX_MEM; addr++)
+    {
+      memcpy(& j, at + addr * sizeof(uint16_t), sizeof(j));
+      for (; j; j = t.next)
+	{
+	  if ((j > count) || seen[j - 1])
+	    return false;
+	  seen[j - 1] = true;
+	  memcpy(& t, list + (j - 1) * sizeof(text_t), sizeof(t));
+	  if ((t.len < 1) || (t.len > MAX_MEM - addr) ||
+	      (t.offset > used) || (t.len > used - t.offset))
+	    return false;
+	}
+    }
+  return true;
+}
@@ -0,0 +1,170 @@
+// I2L interpreter - trace filters
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// With any filter, an instruction is traced only if it is inside the
+// instruction count window, at an address in one of the ranges if
+// any are given, and inside one of the procedures if any are given;
+// then only every Nth of those is traced.  A procedure's dynamic
+// extent is the lifetime of the frame its outermost activation
+// builds, which ends when hp drops below the frame, whether by RET or
+// by RESTART.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+bool tracing;
+bool trace_filtered;
+bool trace_calls;
+uint64_t trace_first = 0;
+uint64_t trace_last = UINT64_MAX;
+uint64_t trace_every = 1;
+
+typedef struct
+{
+  uint16_t first;
+  uint16_t last;
+} trace_range_t;
+
+typedef struct
+{
+  char *name;      // as given on the command line
+  uint16_t addr;
+  uint16_t frame;  // of the outermost activation, or 0 if not active
+} trace_proc_t;
+
+#define MAX_TRACE_RANGES 16
+#define MAX_TRACE_PROCS 16
+
+static trace_range_t ranges[MAX_TRACE_RANGES];
+static int range_count;
+static trace_proc_t procs[MAX_TRACE_PROCS];
+static int proc_count;
+static uint64_t skipped;
+
+
+// hex addresses, as in the trace: "1a00-1b40", inclusive
+void trace_add_range(char *arg)
+{
+  char *end;
+  unsigned long first, last;
+
+  if (range_count == MAX_TRACE_RANGES)
+    fatal_error(ERR_BAD_CMD_LINE, "too many trace ranges");
+  first = strtoul(arg, & end, 16);
+  if ((end == arg) || (*end != '-'))
+    fatal_error(ERR_BAD_CMD_LINE, "bad trace range %s", arg);
+  last = strtoul(end + 1, & end, 16);
+  if (*end || (first > last) || (last >= MAX_MEM))
+    fatal_error(ERR_BAD_CMD_LINE, "bad trace range %s", arg);
+  ranges[range_count].first = first;
+  ranges[range_count].last = last;
+  range_count++;
+  trace_filtered = true;
+}
+
+
+// a CAL target address in hex, or a name from the symbol map, which
+// may be loaded after this option
+void trace_add_proc(char *arg)
+{
+  if (proc_count == MAX_TRACE_PROCS)
+    fatal_error(ERR_BAD_CMD_LINE, "too many trace procedures");
+  procs[proc_count++].name = arg;
+  trace_filtered = true;
+  trace_calls = true;
+}
+
+
+// A name can have more than one address, the forward declaration's
+// as well as the procedure's, which get entries of their own.
+void trace_start(void)
+{
+  int count = proc_count;
+  int i, j;
+
+  for (i = 0; i < count; i++)
+    {
+      trace_proc_t *p = & procs[i];
+      uint16_t addrs[MAX_TRACE_PROCS];
+      char *end;
+      unsigned long addr;
+      int n;
+
+      n = symbol_addrs(p->name, addrs, MAX_TRACE_PROCS);
+      if (n)
+	{
+	  if (proc_count + n - 1 > MAX_TRACE_PROCS)
+	    fatal_error(ERR_BAD_CMD_LINE, "too many trace procedures");
+	  p->addr = addrs[0];
+	  for (j = 1; j < n; j++)
+	    {
+	      procs[proc_count].name = p->name;
+	      procs[proc_count++].addr = addrs[j];
+	    }
+	  continue;
+	}
+      if (strcmp(p->name, "main") == 0)
+	{
+	  p->addr = CODE_START;
+	  continue;
+	}
+      addr = strtoul(p->name, & end, 16);
+      if ((end == p->name) || *end || (addr >= MAX_MEM))
+	fatal_error(ERR_BAD_CMD_LINE, "unknown trace procedure %s", p->name);
+      p->addr = addr;
+    }
+  if ((trace_first > 1) || (trace_last != UINT64_MAX) || (trace_every > 1))
+    trace_filtered = true;
+}
+
+
+// Called by do_call() once the frame is built.
+void trace_enter(uint16_t target)
+{
+  int i;
+
+  for (i = 0; i < proc_count; i++)
+    if ((procs[i].addr == target) && ! procs[i].frame)
+      procs[i].frame = hp;
+}
+
+
+bool trace_filter(uint16_t addr)
+{
+  bool inside;
+  int i;
+
+  // keep track of procedure exits even outside the window
+  inside = ! proc_count;
+  for (i = 0; i < proc_count; i++)
+    if (procs[i].frame)
+      {
+	if (hp < procs[i].frame)
+	  procs[i].frame = 0;
+	else
+	  inside = true;
+      }
+  if ((insn_count < trace_first) || (insn_count > trace_last) || ! inside)
+    return false;
+
+  if (range_count)
+    {
+      for (i = 0; i < range_count; i++)
+	if ((addr >= ranges[i].first) && (addr <= ranges[i].last))
+	  break;
+      if (i == range_count)
+	return false;
+    }
+
+  if (++skipped < trace_every)
+    return false;
+  skipped = 0;
+  return true;
+}
@@ -0,0 +1,85 @@
+// I2L interpreter - sparse copies of memory
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// A scheduled VM's memory is kept as 256-byte pages, each stored only
+// if it differs from the program's loaded image, which in turn stores
+// only the pages that aren't all zero.  The image is shared by all the
+// VMs running the program and never written, so code pages cost a VM
+// nothing unless it writes into its code, when the page is copied.
+// A missing page reads as zero, as untouched memory did.  A program
+// like demo/prime keeps a stack page and its heap, some 9K, rather
+// than the whole 64K.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+static const uint8_t zero_page[VMEM_PAGE_SIZE];
+
+
+// The page that a missing page of pages stands for.
+static inline const uint8_t *base_page(const vmem_t *base, int i)
+{
+  return (base && base->page[i]) ? base->page[i] : zero_page;
+}
+
+
+// Stores the pages of mem[] that differ from base, or from zero if
+// base is NULL, and drops any that no longer do.
+void vmem_capture(vmem_t *pages, const vmem_t *base)
+{
+  int i;
+
+  for (i = 0; i < VMEM_PAGES; i++)
+    {
+      uint8_t *p = & mem[i * VMEM_PAGE_SIZE];
+      if (memcmp(p, base_page(base, i), VMEM_PAGE_SIZE) == 0)
+	{
+	  free(pages->page[i]);
+	  pages->page[i] = NULL;
+	  continue;
+	}
+      if (! pages->page[i])
+	{
+	  pages->page[i] = malloc(VMEM_PAGE_SIZE);
+	  if (! pages->page[i])
+	    fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+	}
+      memcpy(pages->page[i], p, VMEM_PAGE_SIZE);
+    }
+}
+
+
+// Copies pages back into mem[].  Zero pages that are already zero
+// aren't written, so that memory never used isn't committed.
+void vmem_restore(const vmem_t *pages, const vmem_t *base)
+{
+  int i;
+
+  for (i = 0; i < VMEM_PAGES; i++)
+    {
+      uint8_t *p = & mem[i * VMEM_PAGE_SIZE];
+      const uint8_t *src = pages->page[i] ? pages->page[i] : base_page(base, i);
+      if ((src != zero_page) || memcmp(p, zero_page, VMEM_PAGE_SIZE))
+	memcpy(p, src, VMEM_PAGE_SIZE);
+    }
+}
+
+
+void vmem_free(vmem_t *pages)
+{
+  int i;
+
+  for (i = 0; i < VMEM_PAGES; i++)
+    {
+      free(pages->page[i]);
+      pages->page[i] = NULL;
+    }
+}
+
@@ -0,0 +1,169 @@
+// I2L interpreter - extended memory
+// Copyright 2016 Eric Smith <spacewar@gmail.com>
+
+// Extended memory holds data that doesn't fit in the 64K address
+// space.  It's addressed in 16-byte paragraphs, as on the 8086, by a
+// segment number returned by XRESERVE and an offset, and is reserved
+// and released like the heap.  Programs copy data between it and
+// their own memory with XGET and XPUT, or a byte at a time with XPEEK
+// and XPOKE.
+//
+// The V4D compiler only accepts intrinsic numbers up to 63, all of
+// which some dialect uses, so the intrinsics are registered as native
+// functions, only when extended memory is configured, at numbers of
+// floating point intrinsics, which V4D programs don't have:
+//   'CODE' XRESERVE=$38, XRELEASE=$39, XPEEK=$3A, XPOKE=$3B,
+//          XGET=$3C, XPUT=$3D, XSPACE=$3E;
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "i2l.h"
+
+
+uint8_t *xmem;        // allocated when first reserved
+uint32_t xmem_paras;  // size in paragraphs, 0 for none
+uint32_t xmem_top;    // paragraphs reserved
+
+
+// Byte index in xmem[] of count bytes from seg:offset, which must
+// have been reserved.
+static uint32_t xmem_addr(uint16_t seg, uint16_t offset, uint16_t count)
+{
+  uint32_t addr = (uint32_t) seg * XMEM_PARAGRAPH + offset;
+  if (addr + count > xmem_top * XMEM_PARAGRAPH)
+    fatal_error(ERR_HEAP_OVERFLOW, "extended memory address %04x:%04x out of range", seg, offset);
+  return addr;
+}
+
+static uint16_t mem_addr(uint16_t addr, uint16_t count)
+{
+  if (addr + count > MAX_MEM)
+    fatal_error(ERR_HEAP_OVERFLOW, "address %04x out of range", addr);
+  return addr;
+}
+
+
+// XRESERVE(paragraphs), returns the segment
+static void xreserve(const i2l_native_api_t *api, void *ctx)
+{
+  uint16_t paras = api->pop();
+
+  (void) ctx;
+  if (xmem_top + paras > xmem_paras)
+    fatal_error(ERR_HEAP_OVERFLOW, NULL);
+  if (! xmem)
+    {
+      xmem = malloc(xmem_paras * XMEM_PARAGRAPH);
+      if (! xmem)
+	fatal_error(ERR_INTERNAL_ERROR, "out of memory");
+    }
+  memset(& xmem[xmem_top * XMEM_PARAGRAPH], 0, paras * XMEM_PARAGRAPH);
+  api->push(xmem_top);
+  xmem_top += paras;
+}
+
+// XRELEASE(segment), also releases all reserved after it
+static void xrelease(const i2l_native_api_t *api, void *ctx)
+{
+  uint16_t seg = api->pop();
+
+  (void) ctx;
+  if (seg > xmem_top)
+    fatal_error(ERR_HEAP_UNDERFLOW, NULL);
+  xmem_top = seg;
+}
+
+// XPEEK(segment, offset)
+static void xpeek(const i2l_native_api_t *api, void *ctx)
+{
+  uint16_t offset = api->pop();
+  uint16_t seg = api->pop();
+
+  (void) ctx;
+  api->push(xmem[xmem_addr(seg, offset, 1)]);
+}
+
+// XPOKE(segment, offset, byte)
+static void xpoke(const i2l_native_api_t *api, void *ctx)
+{
+  uint8_t value = api->pop();
+  uint16_t offset = api->pop();
+  uint16_t seg = api->pop();
+
+  (void) ctx;
+  xmem[xmem_addr(seg, offset, 1)] = value;
+}
+
+// XGET(segment, offset, address, count) copies from extended memory
+static void xget(const i2l_native_api_t *api, void *ctx)
+{
+  uint16_t count = api->pop();
+  uint16_t addr = api->pop();
+  uint16_t offset = api->pop();
+  uint16_t seg = api->pop();
+
+  (void) ctx;
+  memcpy(& mem[mem_addr(addr, count)], & xmem[xmem_addr(seg, offset, count)], count);
+}
+
+// XPUT(segment, offset, address, count) copies to extended memory
+static void xput(const i2l_native_api_t *api, void *ctx)
+{
+  uint16_t count = api->pop();
+  uint16_t addr = api->pop();
+  uint16_t offset = api->pop();
+  uint16_t seg = api->pop();
+
+  (void) ctx;
+  memcpy(& xmem[xmem_addr(seg, offset, count)], & mem[mem_addr(addr, count)], count);
+}
+
+// XSPACE, paragraphs free, at most 0xffff
+static void xspace(const i2l_native_api_t *api, void *ctx)
+{
+  uint32_t paras = xmem_paras - xmem_top;
+
+  (void) ctx;
+  api->push((paras > 0xffff) ? 0xffff : paras);
+}
+
+
+typedef struct
+{
+  int num;
+  const char *name;
+  i2l_native_fn *fn;
+} xmem_intrinsic_t;
+
+static const xmem_intrinsic_t xmem_intrinsics[] =
+{
+  { 0x38, "xreserve", xreserve },
+  { 0x39, "xrelease", xrelease },
+  { 0x3a, "xpeek",    xpeek },
+  { 0x3b, "xpoke",    xpoke },
+  { 0x3c, "xget",     xget },
+  { 0x3d, "xput",     xput },
+  { 0x3e, "xspace",   xspace },
+};
+
+
+void xmem_start(void)
+{
+  static bool registered;
+  unsigned int i;
+
+  if (registered)
+    return;
+  for (i = 0; i < sizeof(xmem_intrinsics) / sizeof(xmem_intrinsics[0]); i++)
+    {
+      const xmem_intrinsic_t *x = & xmem_intrinsics[i];
+      if (native_register_intrinsic(x->num, x->name, x->fn, NULL))
+	fatal_error(ERR_BAD_CMD_LINE, "intrinsic %d for extended memory is taken", x->num);
+    }
+  registered = true;
+}